@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+
+# Simulate a reader inventorying several SiliCa cards in one field.
+# Each card is a separate instance of the natively compiled firmware, so the
+# time slot is chosen by the firmware's Polling path (POLLING_SLOT_STRATEGY).
+# The reader repeats Polling with a fixed number of time slots until every
+# card has answered alone in some slot, and the simulation reports cards
+# identified per second and the share of occupied slots that collided.
+# Usage examples:
+# python anticollision.py
+# python anticollision.py --cards 2 4 8 --slots 1 4 16 --trials 200
+
+import ctypes
+import random
+import sys
+import argparse
+
+import native
+
+# POLLING_SLOT_STRATEGY values in main.cpp
+STRATEGIES = {"fixed": 0, "random": 1, "idm": 2}
+
+BIT_RATE = 212e3
+# header (preamble and sync) and EDC around each packet
+FRAME_OVERHEAD = 8 + 2
+POLLING_LEN = 6
+
+# response timing of the firmware (see loop() in silica.cpp)
+POLLING_DELAY = 2.5e-3
+TIME_SLOT = 1.2083e-3
+
+COMMAND_WRITE = 0x08
+D_ID = 0x83
+DEFAULT_PMM = bytes.fromhex("0001FFFFFFFFFFFF")
+
+
+class Card:
+    """
+    One instance of the firmware with its own state.
+    """
+
+    def __init__(self, flags: tuple[str, ...], instance: int):
+        self.lib = native.load(flags, instance)
+        self.response = ctypes.create_string_buffer(0x100)
+
+        # start from an erased EEPROM (IDm FFFFFFFFFFFFFFFF)
+        size = self.lib.silica_eeprom_size()
+        ctypes.memset(self.lib.silica_eeprom(), 0xFF, size)
+        self.lib.silica_initialize()
+        self.idm = b"\xFF" * 8
+
+    def set_idm(self, idm: bytes) -> None:
+        # Write Without Encryption to D_ID, like write.py does
+        data = self.idm + bytes([1, 0xFF, 0xFF, 1, 0x80, D_ID]) + idm + DEFAULT_PMM
+        self.process(bytes([2 + len(data), COMMAND_WRITE]) + data)
+        self.idm = idm
+
+    def process(self, command: bytes) -> bytes | None:
+        length = self.lib.silica_process(command, self.response)
+        return self.response.raw[:length] if length else None
+
+    def polling(self, slots: int) -> tuple[int, bytes] | None:
+        """
+        Returns (time slot, IDm) of the response, or None.
+        """
+        rsp = self.process(bytes([POLLING_LEN, 0x00, 0xFF, 0xFF, 0x00, slots - 1]))
+        if rsp is None:
+            return None
+        return self.lib.silica_time_slot(), rsp[2:10]
+
+
+def air_time(length: int) -> float:
+    return (FRAME_OVERHEAD + length) * 8 / BIT_RATE
+
+
+def inventory(cards: list[Card], slots: int, gap: float, max_rounds: int,
+              stats: dict) -> None:
+    """
+    Poll until all cards are identified or max_rounds is reached.
+    """
+    # one Polling round: command, wait for all slots, reader turnaround
+    round_time = air_time(POLLING_LEN) + POLLING_DELAY + slots * TIME_SLOT + gap
+
+    identified = set()
+    for _ in range(max_rounds):
+        stats["rounds"] += 1
+        stats["time"] += round_time
+
+        occupied = {}
+        for card in cards:
+            result = card.polling(slots)
+            if result is not None:
+                slot, idm = result
+                occupied.setdefault(slot, []).append(idm)
+
+        for answers in occupied.values():
+            stats["occupied"] += 1
+            if len(answers) == 1:
+                identified.add(answers[0])
+            else:
+                stats["collisions"] += 1
+
+        if len(identified) == len(cards):
+            break
+
+    stats["identified"] += len(identified)
+    stats["complete"] += len(identified) == len(cards)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Compare Polling time slot strategies for several cards in one field.",
+    )
+    parser.add_argument("--cards", type=int, nargs="+", default=[2, 4, 8])
+    parser.add_argument("--slots", type=int, nargs="+", default=[1, 2, 4, 8, 16],
+                        help="numbers of time slots the reader polls with")
+    parser.add_argument("--strategy", nargs="+", choices=STRATEGIES,
+                        default=list(STRATEGIES))
+    parser.add_argument("--trials", type=int, default=100)
+    parser.add_argument("--max-rounds", type=int, default=50)
+    parser.add_argument("--gap", type=float, default=1e-3,
+                        help="reader turnaround between Polling rounds in seconds")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args(argv[1:])
+
+    for slots in args.slots:
+        if slots not in (1, 2, 4, 8, 16):
+            print("The number of time slots must be 1, 2, 4, 8 or 16")
+            return 1
+
+    rng = random.Random(args.seed)
+    print(f"{'strategy':8s} {'cards':>5s} {'slots':>5s} {'cards/s':>8s} "
+          f"{'rounds':>7s} {'collided':>8s} {'complete':>8s}")
+
+    for name in args.strategy:
+        flags = (f"-DPOLLING_SLOT_STRATEGY={STRATEGIES[name]}",)
+        pool = [Card(flags, i) for i in range(max(args.cards))]
+
+        for n in args.cards:
+            cards = pool[:n]
+            for slots in args.slots:
+                stats = dict(rounds=0, time=0.0, occupied=0, collisions=0,
+                             identified=0, complete=0)
+                for _ in range(args.trials):
+                    # a new set of cards for every trial
+                    for card in cards:
+                        card.set_idm(rng.randbytes(8))
+                    inventory(cards, slots, args.gap, args.max_rounds, stats)
+
+                print(f"{name:8s} {n:5d} {slots:5d} "
+                      f"{stats['identified'] / stats['time']:8.1f} "
+                      f"{stats['rounds'] / args.trials:7.2f} "
+                      f"{100 * stats['collisions'] / max(1, stats['occupied']):7.1f}% "
+                      f"{100 * stats['complete'] / args.trials:7.1f}%")
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
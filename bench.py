@@ -0,0 +1,336 @@
+#!/usr/bin/env python3
+
+# Round-trip latency and soak benchmark for SiliCa.
+# Runs Polling, Request Response, Read and Write transactions
+# (Read/Write at every block count) and records per-command round-trip
+# statistics, retries and error statuses as JSON for comparing builds.
+# With --probe, the timing probe diagnostic command splits the round trip
+# into air time, card decode, card process, card turnaround and reader
+# overhead, using the card's timer stamps, and reports the run-time
+# accounting of the card's deferred tasks.
+# With --pipeline, Polling, Request Service, Read and Write run back-to-back
+# without pauses, as in a reader transaction, and the achieved commands per
+# second and resync failures (retries) are reported. Only runs on a real
+# card measure the receiver re-arm: the virtual card models no SPI timing,
+# echo or re-arm, so it reports host processing speed only.
+# Note: Write overwrites the user blocks of the card.
+# Usage examples:
+# python bench.py -o v1_1.json
+# python bench.py -n 5000 --rounds 10 --label nightly -o soak.json
+# python bench.py --probe -n 200
+# python bench.py --pipeline -n 1000
+# python bench.py --device "silica:card.eep?latency=0.001&ber=1e-5"
+
+import json
+import random
+import sys
+import time
+import argparse
+
+import nfc
+
+COMMAND_POLLING = 0x00
+COMMAND_REQUEST_SERVICE = 0x02
+COMMAND_REQUEST_RESPONSE = 0x04
+COMMAND_READ = 0x06
+COMMAND_WRITE = 0x08
+COMMAND_DIAGNOSTIC = 0xF0
+DIAGNOSTIC_TIMING_PROBE = 0x01
+DIAGNOSTIC_TASK_STATS = 0x02
+# task_id_t in silica.h
+TASKS = ["serial", "save_error"]
+MAX_BLOCK = 12
+
+BIT_RATE = 212e3
+# header (preamble and sync) and EDC around each packet
+FRAME_OVERHEAD = 8 + 2
+# Polling response delay of the card before time slot 0
+POLLING_DELAY_US = 2500
+# card timer (TCB0) tick, fc/4
+TICK_US = 4 / 13.56
+# payload sizes of the timing probe, to show how decoding scales
+PROBE_SIZES = [0, 64, 128, 252]
+
+HISTOGRAM_BIN_US = 100
+
+
+class Stats:
+    """
+    Round-trip times and outcomes of one kind of transaction.
+    """
+
+    def __init__(self):
+        self.times = []  # seconds, successful transactions only
+        self.retries = 0
+        self.failures = 0
+        self.status = {}  # "SF1SF2" -> count
+
+    def summary(self) -> dict:
+        t = sorted(self.times)
+        result = {
+            "count": len(t),
+            "retries": self.retries,
+            "failures": self.failures,
+            "status": self.status,
+        }
+        if t:
+            us = [x * 1e6 for x in t]
+            histogram = {}
+            for x in us:
+                b = int(x // HISTOGRAM_BIN_US) * HISTOGRAM_BIN_US
+                histogram[b] = histogram.get(b, 0) + 1
+            result.update({
+                "mean_us": sum(us) / len(us),
+                "p50_us": us[len(us) // 2],
+                "p99_us": us[min(len(us) - 1, len(us) * 99 // 100)],
+                "max_us": us[-1],
+                "histogram_bin_us": HISTOGRAM_BIN_US,
+                "histogram": {str(k): v for k, v in sorted(histogram.items())},
+            })
+        return result
+
+
+def transact(clf: nfc.ContactlessFrontend, frame: bytes, stats: Stats,
+             retries: int, timeout: float) -> bytes | None:
+    """
+    Exchange one frame, retrying on communication errors.
+    Returns the response or None if all attempts failed.
+    """
+    for attempt in range(retries + 1):
+        start = time.perf_counter()
+        try:
+            rsp = clf.exchange(frame, timeout)
+        except nfc.clf.CommunicationError:
+            if attempt < retries:
+                stats.retries += 1
+            continue
+        stats.times.append(time.perf_counter() - start)
+        return rsp
+    stats.failures += 1
+    return None
+
+
+def check_status(rsp: bytes | None, stats: Stats) -> None:
+    if rsp is not None and len(rsp) >= 12 and (rsp[10] or rsp[11]):
+        key = rsp[10:12].hex().upper()
+        stats.status[key] = stats.status.get(key, 0) + 1
+
+
+def block_list(n: int) -> bytes:
+    return b"".join(bytes([0x80, i]) for i in range(n))
+
+
+def air_time_us(length: int) -> float:
+    return (FRAME_OVERHEAD + length) * 8 / BIT_RATE * 1e6
+
+
+def probe(clf, count: int, retries: int, timeout: float, results: dict) -> None:
+    """
+    Split round trips of the timing probe using the card's timer stamps.
+    """
+    for size in PROBE_SIZES:
+        frame = bytes([3 + size, COMMAND_DIAGNOSTIC, DIAGNOSTIC_TIMING_PROBE]) + bytes(size)
+        stats = Stats()
+        parts = {"air": [], "decode": [], "process": [], "turnaround": [], "reader": []}
+        for _ in range(count):
+            rsp = transact(clf, frame, stats, retries, timeout)
+            if rsp is None or len(rsp) < 11 or rsp[1:3] != b"\xF1\x01":
+                continue
+            frame_end, decoded, processed, transmit = (
+                int.from_bytes(rsp[i:i + 2], "big") for i in range(3, 11, 2))
+
+            def ticks(a: int, b: int) -> float:
+                return ((b - a) & 0xFFFF) * TICK_US
+
+            round_trip = stats.times[-1] * 1e6
+            air = air_time_us(len(frame)) + air_time_us(rsp[0])
+            card = ticks(frame_end, transmit)
+            parts["air"].append(air)
+            parts["decode"].append(ticks(frame_end, decoded))
+            parts["process"].append(ticks(decoded, processed))
+            parts["turnaround"].append(ticks(processed, transmit))
+            parts["reader"].append(round_trip - air - card)
+
+        summary = stats.summary()
+        summary["split_us"] = {
+            name: sorted(v)[len(v) // 2] for name, v in parts.items() if v
+        }
+        results[f"probe_{size}"] = summary
+
+
+def pipeline(clf, idm: bytes, count: int, retries: int, timeout: float) -> dict:
+    """
+    Back-to-back Polling, Request Service, Read and Write sequences.
+    """
+    def frame(code: int, data: bytes) -> bytes:
+        return bytes([2 + len(data), code]) + data
+
+    sequence = [
+        frame(COMMAND_POLLING, bytes([0xFF, 0xFF, 0x00, 0x00])),
+        frame(COMMAND_REQUEST_SERVICE, idm + bytes([1, 0xFF, 0xFF])),
+        frame(COMMAND_READ, idm + bytes([1, 0xFF, 0xFF, 1]) + block_list(1)),
+        frame(COMMAND_WRITE, idm + bytes([1, 0xFF, 0xFF, 1]) + block_list(1) + bytes(16)),
+    ]
+    stats = Stats()
+    air = 0.0
+    start = time.perf_counter()
+    for _ in range(count):
+        for f in sequence:
+            rsp = transact(clf, f, stats, retries, timeout)
+            if f[1] in (COMMAND_READ, COMMAND_WRITE):
+                check_status(rsp, stats)
+            if rsp is not None:
+                air += air_time_us(len(f)) + air_time_us(rsp[0])
+                if f[1] == COMMAND_POLLING:
+                    air += POLLING_DELAY_US
+    elapsed = time.perf_counter() - start
+
+    summary = stats.summary()
+    summary["commands_per_s"] = len(stats.times) / elapsed
+    # upper bound set by the frames on air and the Polling delay
+    summary["air_limit_per_s"] = len(stats.times) / air * 1e6 if air else 0.0
+    return summary
+
+
+def task_stats(clf, timeout: float) -> dict:
+    """
+    Run-time accounting of the card's deferred tasks.
+    """
+    try:
+        rsp = clf.exchange(bytes([3, COMMAND_DIAGNOSTIC, DIAGNOSTIC_TASK_STATS]), timeout)
+    except nfc.clf.CommunicationError:
+        return {}
+    result = {}
+    for i, name in enumerate(TASKS):
+        p = rsp[3 + 10 * i:13 + 10 * i]
+        if len(p) < 10:
+            break
+        steps = int.from_bytes(p[0:2], "big")
+        total = int.from_bytes(p[6:10], "big")
+        result[name] = {
+            "steps": steps,
+            "max_us": int.from_bytes(p[2:4], "big") * TICK_US,
+            "overruns": int.from_bytes(p[4:6], "big"),
+            "mean_us": total / steps * TICK_US if steps else 0.0,
+        }
+    return result
+
+
+def run(clf, idm: bytes, count: int, retries: int, timeout: float,
+        results: dict[str, Stats]) -> None:
+    def frame(code: int, data: bytes) -> bytes:
+        return bytes([2 + len(data), code]) + data
+
+    stats = results.setdefault("polling", Stats())
+    for _ in range(count):
+        transact(clf, frame(COMMAND_POLLING, bytes([0xFF, 0xFF, 0x00, 0x00])),
+                 stats, retries, timeout)
+
+    stats = results.setdefault("request_response", Stats())
+    for _ in range(count):
+        transact(clf, frame(COMMAND_REQUEST_RESPONSE, idm), stats, retries, timeout)
+
+    for n in range(1, MAX_BLOCK + 1):
+        stats = results.setdefault(f"read_{n}", Stats())
+        cmd = idm + bytes([1, 0xFF, 0xFF, n]) + block_list(n)
+        for _ in range(count):
+            rsp = transact(clf, frame(COMMAND_READ, cmd), stats, retries, timeout)
+            check_status(rsp, stats)
+
+        stats = results.setdefault(f"write_{n}", Stats())
+        for _ in range(count):
+            cmd = idm + bytes([1, 0xFF, 0xFF, n]) + block_list(n) + random.randbytes(16 * n)
+            rsp = transact(clf, frame(COMMAND_WRITE, cmd), stats, retries, timeout)
+            check_status(rsp, stats)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Measure SiliCa round-trip latency per command.",
+    )
+    parser.add_argument("-d", "--device", default="usb", help="nfcpy device path")
+    parser.add_argument("-n", "--count", type=int, default=1000,
+                        help="transactions per command and block count")
+    parser.add_argument("--rounds", type=int, default=1,
+                        help="repeat the whole run (soak test)")
+    parser.add_argument("--retries", type=int, default=2)
+    parser.add_argument("--timeout", type=float, default=0.1)
+    parser.add_argument("--label", default="", help="firmware build label")
+    parser.add_argument("--probe", action="store_true",
+                        help="split round trips with the timing probe instead")
+    parser.add_argument("--pipeline", action="store_true",
+                        help="run back-to-back transactions and report commands per second "
+                             "(meaningful on a real card only)")
+    parser.add_argument("-o", "--output", help="JSON output file (default: stdout)")
+    args = parser.parse_args(argv[1:])
+
+    if args.device.startswith("silica:"):
+        import virtual  # registers the virtual card device path
+
+    results = {}
+    with nfc.ContactlessFrontend(args.device) as clf:
+        print("Waiting for a FeliCa...", file=sys.stderr)
+        tag = clf.connect(
+            rdwr={"targets": ["212F"], 'on-connect': lambda tag: False})
+        if tag is None:
+            print("No tag found", file=sys.stderr)
+            return 1
+        print("Tag found:", tag, file=sys.stderr)
+
+        start = time.perf_counter()
+        probes = {}
+        pipelines = []
+        for i in range(args.rounds):
+            if args.probe:
+                probe(clf, args.count, args.retries, args.timeout, probes)
+            elif args.pipeline:
+                pipelines.append(pipeline(clf, bytes(tag.idm), args.count,
+                                          args.retries, args.timeout))
+            else:
+                run(clf, bytes(tag.idm), args.count, args.retries, args.timeout, results)
+            print(f"Round {i + 1}/{args.rounds} done", file=sys.stderr)
+        elapsed = time.perf_counter() - start
+        tasks = task_stats(clf, args.timeout) if args.probe else {}
+
+    report = {
+        "label": args.label,
+        "device": args.device,
+        "count": args.count,
+        "rounds": args.rounds,
+        "seconds": elapsed,
+        "commands": {name: s.summary() for name, s in results.items()},
+    }
+    if args.probe:
+        report["probes"] = probes
+        report["tasks"] = tasks
+    if args.pipeline:
+        report["pipeline"] = pipelines
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+    for name, s in results.items():
+        r = s.summary()
+        if r["count"]:
+            print(f"{name:18s} p50 {r['p50_us']:8.0f} us  p99 {r['p99_us']:8.0f} us  "
+                  f"max {r['max_us']:8.0f} us  retries {r['retries']}  failures {r['failures']}",
+                  file=sys.stderr)
+    for name, r in report.get("probes", {}).items():
+        split = "  ".join(f"{k} {v:6.0f}" for k, v in r["split_us"].items())
+        print(f"{name:18s} {split}  (median us)", file=sys.stderr)
+    for i, r in enumerate(report.get("pipeline", [])):
+        print(f"pipeline {i + 1:10d} {r['commands_per_s']:8.0f} commands/s  "
+              f"(air limit {r['air_limit_per_s']:.0f})  retries {r['retries']}  "
+              f"failures {r['failures']}", file=sys.stderr)
+    for name, t in report.get("tasks", {}).items():
+        print(f"task {name:13s} steps {t['steps']:6d}  mean {t['mean_us']:6.1f} us  "
+              f"max {t['max_us']:6.1f} us  overruns {t['overruns']}", file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+
+# Record raw frames streamed by a SiliCa built with CAPTURE_FRAMES
+# (pio run -e ATtiny1616_capture) into a binary corpus file.
+# Text output of the card is passed through to the console.
+# Usage example:
+# python capture.py /dev/ttyUSB0 field.slcf
+
+import math
+import random
+import struct
+import sys
+import argparse
+from typing import BinaryIO, Iterator
+
+CORPUS_MAGIC = b"SLCF"
+CORPUS_VERSION = 1
+
+RECORD_MARKER = b"\xA5\x5A"
+BAUDRATE = 115200
+
+
+def crc16(data: bytes) -> int:
+    """
+    CRC16-CCITT as calculated by the firmware (XMODEM variant).
+    """
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+# data link layer header (preamble and sync code)
+HEADER = bytes([0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB2, 0x4D])
+
+# Manchester code of each byte as the card samples it (2 samples per bit)
+MANCHESTER = [
+    sum((0b10 if (b >> k) & 1 else 0b01) << (2 * k) for k in range(8))
+    for b in range(256)
+]
+
+
+def flip_bits(value: int, nbits: int, ber: float, rng: random.Random) -> int:
+    """
+    Flip each of the lower nbits of value with probability ber.
+    """
+    if ber <= 0:
+        return value
+    pos = -1
+    while True:
+        # distance to the next error is geometrically distributed
+        pos += 1 + int(math.log(1.0 - rng.random()) / math.log(1.0 - ber))
+        if pos >= nbits:
+            return value
+        value ^= 1 << pos
+
+
+def modulate(packet: bytes, shift: int = 0, invert: bool = False,
+             ber: float = 0.0, rng: random.Random = random) -> bytes:
+    """
+    Encode a packet into the raw samples capture_frame() stores:
+    header, packet and EDC, Manchester encoded, starting `shift` samples
+    late and followed by an idle byte.
+    """
+    frame = HEADER + packet + crc16(packet).to_bytes(2, "big")
+    value = 0
+    for b in frame:
+        value = (value << 16) | MANCHESTER[b]
+    nbits = 16 * len(frame)
+    value = flip_bits(value, nbits, ber, rng)
+
+    # delay by shift samples and pad to whole bytes with idle level
+    value <<= 8 - shift
+    total = nbits + 8
+    if invert:
+        value ^= (1 << total) - 1
+    return value.to_bytes(total // 8, "big") + (b"\xFF" if invert else b"\x00")
+
+
+def demodulate(chips: bytes) -> bytes | None:
+    """
+    Decode Manchester chips (2 per bit, MSB first) as the card transmits
+    them into header, packet and EDC. Returns None for an invalid code.
+    """
+    value = int.from_bytes(chips, "big")
+    data = 0
+    for k in range(8 * len(chips) // 2 - 1, -1, -1):
+        pair = (value >> (2 * k)) & 0b11
+        if pair not in (0b10, 0b01):
+            return None
+        data = (data << 1) | (pair == 0b10)
+    return data.to_bytes(len(chips) // 2, "big")
+
+
+# Corpus format:
+#   header: "SLCF" <version (1 byte)>
+#   record: <on-card decode result (1 byte)> <length (2 bytes, LE)> <raw samples>
+
+def write_corpus_header(f: BinaryIO) -> None:
+    f.write(CORPUS_MAGIC + bytes([CORPUS_VERSION]))
+
+
+def write_corpus_record(f: BinaryIO, result: int, raw: bytes) -> None:
+    f.write(struct.pack("<BH", result, len(raw)) + raw)
+
+
+def read_corpus(f: BinaryIO) -> Iterator[tuple[int, bytes]]:
+    """
+    Yields (result, raw) for each record in a corpus file.
+    """
+    header = f.read(5)
+    if header[0:4] != CORPUS_MAGIC:
+        raise ValueError("not a SiliCa frame corpus")
+    if header[4] != CORPUS_VERSION:
+        raise ValueError(f"unsupported corpus version {header[4]}")
+
+    while True:
+        head = f.read(3)
+        if len(head) < 3:
+            return
+        result, length = struct.unpack("<BH", head)
+        raw = f.read(length)
+        if len(raw) < length:
+            raise ValueError("truncated corpus record")
+        yield result, raw
+
+
+def read_records(port) -> Iterator[tuple[int, bytes] | bytes]:
+    """
+    Parse the serial stream. Yields (result, raw) for each valid record
+    and bytes for text in between.
+    """
+    text = bytearray()
+    while True:
+        b = port.read(1)
+        if not b:
+            continue
+        if b[0] != RECORD_MARKER[0]:
+            text += b
+            if b == b"\n":
+                yield bytes(text)
+                text.clear()
+            continue
+
+        if port.read(1) != RECORD_MARKER[1:]:
+            continue
+        head = port.read(3)
+        result, length = head[0], (head[1] << 8) | head[2]
+        raw = port.read(length)
+        crc = port.read(2)
+        if len(raw) != length or int.from_bytes(crc, "big") != crc16(raw):
+            print("Broken record skipped", file=sys.stderr)
+            continue
+        yield result, raw
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Record raw frames from a SiliCa capture build into a corpus file.",
+    )
+    parser.add_argument("port", help="serial port of the card")
+    parser.add_argument("corpus", help="output corpus file (appended if exists)")
+    parser.add_argument("-b", "--baudrate", type=int, default=BAUDRATE)
+    args = parser.parse_args(argv[1:])
+
+    import serial
+
+    count = 0
+    with serial.Serial(args.port, args.baudrate, timeout=1.0) as port, \
+            open(args.corpus, "ab") as f:
+        if f.tell() == 0:
+            write_corpus_header(f)
+        try:
+            for record in read_records(port):
+                if isinstance(record, bytes):
+                    sys.stdout.write(record.decode("ascii", "replace"))
+                    continue
+                write_corpus_record(f, *record)
+                f.flush()
+                count += 1
+        except KeyboardInterrupt:
+            pass
+
+    print(f"{count} frames captured")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -1,8 +1,8 @@
 import nfc
 import random
 
-COMMAND_READ = 0x06
-COMMAND_WRITE = 0x08
+from provision import read_blocks, stored, write_blocks
+
 MAX_BLOCK = 12
 
 D_ID = 0x83
@@ -11,24 +11,18 @@ SYS_C = 0x85
 
 
 def check(tag, timeout=1.0):
+    # one write per block, confirmed by the CRC in the write response
+    written = []
     for block_num in list(range(MAX_BLOCK)) + [D_ID, SER_C, SYS_C]:
         data = random.randbytes(16)
-        cmd_write = bytearray([1, 0xFF, 0xFF, 1, 0x80, block_num]) + data
-
-        tag.send_cmd_recv_rsp(COMMAND_WRITE, bytes(cmd_write), timeout)
-
-        if block_num == D_ID:  # Update IDm if written
-            tag.idm = data[0:8]
-
-        cmd_read = bytearray([1, 0xFF, 0xFF, 1, 0x80, block_num])
-        ret = tag.send_cmd_recv_rsp(
-            COMMAND_READ, bytes(cmd_read), timeout)[1:]
-
-        if block_num < MAX_BLOCK or block_num == D_ID:
-            assert ret == data, f"Data mismatch in block {block_num}"
-        else:
-            assert ret[0:8] == data[0:8], \
-                f"Data mismatch in system block {block_num}"
+        error = write_blocks(tag, [(block_num, data)], timeout)
+        assert error is None, error
+        written.append((block_num, data))
+
+    # a single multi-block read still covers the read path
+    ret = read_blocks(tag, [n for n, _ in written], timeout)
+    for (block_num, data), r in zip(written, ret):
+        assert r == stored(block_num, data), f"Data mismatch in block {block_num}"
 
 
 def main():
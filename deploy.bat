@@ -1,16 +1,2 @@
 python check.py && ^
-python write.py idm 1122334455667788 && ^
-python write.py sys ABCD && ^
-python write.py ser 000B && ^
-python write.py 0 00000000000000000000000000000000 && ^
-python write.py 1 00000000000000000000000000000000 && ^
-python write.py 2 00000000000000000000000000000000 && ^
-python write.py 3 00000000000000000000000000000000 && ^
-python write.py 4 00000000000000000000000000000000 && ^
-python write.py 5 00000000000000000000000000000000 && ^
-python write.py 6 00000000000000000000000000000000 && ^
-python write.py 7 00000000000000000000000000000000 && ^
-python write.py 8 00000000000000000000000000000000 && ^
-python write.py 9 00000000000000000000000000000000 && ^
-python write.py 10 00000000000000000000000000000000 && ^
-python write.py 11 00000000000000000000000000000000
\ No newline at end of file
+python provision.py card.json
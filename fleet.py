@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+
+# Provision SiliCa cards on every attached reader in parallel.
+# Each reader gets its own worker. IDms are taken from a shared queue,
+# so no two cards get the same IDm, and every card is logged to a CSV file.
+# IDms already present in the log are never assigned again.
+# --mock runs each reader on a natively compiled card (native.py), which
+# times the host side of the per-card work. Throughput on real readers,
+# and whether it scales with their number, has not been measured.
+# Usage examples:
+# python fleet.py card.json --idm-csv idms.csv
+# python fleet.py card.json --idm-range 0123456789AB0000 1000
+# python fleet.py card.json --idm-range 0123456789AB0000 100 --mock 4
+
+import csv
+import ctypes
+import os
+import queue
+import sys
+import threading
+import time
+import argparse
+
+import nfc
+import native
+import provision
+
+LOG_FIELDS = ["time", "reader", "idm", "result", "seconds", "error"]
+
+
+def find_readers() -> list[str]:
+    """
+    Returns nfcpy paths of all attached USB readers.
+    """
+    return [f"usb:{bus:03d}:{dev:03d}"
+            for _, _, bus, dev in nfc.clf.transport.USB.find("usb")]
+
+
+def load_idms(args, used: set[bytes]) -> queue.Queue:
+    idms = []
+    if args.idm_csv:
+        with open(args.idm_csv, newline="") as f:
+            idms += [bytes.fromhex(row["idm"]) for row in csv.DictReader(f)]
+    if args.idm_range:
+        start, count = int(args.idm_range[0], 16), int(args.idm_range[1])
+        idms += [(start + i).to_bytes(8, "big") for i in range(count)]
+
+    q = queue.Queue()
+    for idm in idms:
+        if len(idm) != 8:
+            raise ValueError(f"IDm {idm.hex().upper()} must be exactly 8 bytes")
+        if idm not in used:
+            used.add(idm)  # also drops duplicates within the input
+            q.put(idm)
+    return q
+
+
+def load_used_idms(log_path: str) -> set[bytes]:
+    try:
+        with open(log_path, newline="") as f:
+            return {bytes.fromhex(row["idm"]) for row in csv.DictReader(f)}
+    except FileNotFoundError:
+        return set()
+
+
+class Log:
+    """
+    Thread-safe CSV log of provisioned cards.
+    """
+
+    def __init__(self, path: str):
+        self.lock = threading.Lock()
+        new = not os.path.exists(path)
+        self.file = open(path, "a", newline="")
+        self.writer = csv.DictWriter(self.file, LOG_FIELDS)
+        self.done = 0
+        if new:
+            self.writer.writeheader()
+
+    def write(self, **row) -> None:
+        with self.lock:
+            self.writer.writerow(row)
+            self.done += row["result"] == "ok"
+            self.file.flush()
+            print(" ".join(f"{k}={row[k]}" for k in LOG_FIELDS if row[k] != ""))
+
+    def close(self) -> None:
+        self.file.close()
+
+
+def card_image(image: dict, idm: bytes) -> dict:
+    """
+    Returns a copy of a card image with the IDm replaced.
+    """
+    pmm = provision.DEFAULT_PMM
+    system = []
+    for n, data in image["system"]:
+        if n == provision.D_ID:
+            pmm = data[8:16]
+        else:
+            system.append((n, data))
+    system.append((provision.D_ID, idm + pmm))
+    return {"user": image["user"], "system": system}
+
+
+def worker(path: str, open_frontend, image: dict, idms: queue.Queue, log: Log,
+           stop: threading.Event) -> None:
+    """
+    Provision cards on one reader until the IDm queue is empty or stop is set.
+    """
+    def on_connect(tag):
+        try:
+            idm = idms.get_nowait()
+        except queue.Empty:
+            return False
+
+        start = time.perf_counter()
+        try:
+            error = provision.provision(tag, card_image(image, idm))
+        except (nfc.tag.tt3.Type3TagCommandError, nfc.clf.CommunicationError) as exc:
+            error = str(exc) or type(exc).__name__
+        elapsed = time.perf_counter() - start
+
+        # a failed IDm is never reused: the card might already carry it
+        log.write(time=time.strftime("%Y-%m-%dT%H:%M:%S"), reader=path,
+                  idm=idm.hex().upper(), result="ok" if error is None else "failed",
+                  seconds=f"{elapsed:.3f}", error=error or "")
+        return True  # wait for removal
+
+    # also ends the wait for a card or its removal
+    def terminate():
+        return stop.is_set() or idms.empty()
+
+    with open_frontend(path) as clf:
+        while not terminate():
+            if not clf.connect(rdwr={"targets": ["212F"], "on-connect": on_connect},
+                               terminate=terminate):
+                break
+
+
+class MockTag:
+    """
+    Type 3 tag on a natively compiled SiliCa, presented with an erased EEPROM.
+    """
+
+    def __init__(self, lib: ctypes.CDLL):
+        self.lib = lib
+        ctypes.memset(lib.silica_eeprom(), 0xFF, lib.silica_eeprom_size())
+        lib.silica_initialize()
+        # Polling for any system code
+        self.idm = native.command(lib, bytes([0x00, 0xFF, 0xFF, 0x00, 0x00]))[1:9]
+
+    def send_cmd_recv_rsp(self, cmd_code, cmd_data, timeout, send_idm=True, check_status=True):
+        rsp = native.command(self.lib, bytes([cmd_code]) + (self.idm if send_idm else b"")
+                             + bytes(cmd_data))
+        if not rsp:
+            raise nfc.tag.tt3.Type3TagCommandError(nfc.tag.TIMEOUT_ERROR)
+        if check_status and rsp[9] != 0x00:
+            raise nfc.tag.tt3.Type3TagCommandError(rsp[9] << 8 | rsp[10])
+        return rsp[11:] if check_status else rsp[9:]
+
+
+class MockFrontend:
+    """
+    Stand-in for nfc.ContactlessFrontend presenting a new card at once.
+    Each mock reader ("mock:<n>") has its own firmware instance.
+    """
+
+    def __init__(self, path: str):
+        self.path = path
+        self.lib = native.load(instance=int(path.partition(":")[2]))
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        return False
+
+    def connect(self, rdwr, terminate=lambda: False):
+        if terminate():
+            return None
+        tag = MockTag(self.lib)
+        rdwr["on-connect"](tag)
+        return tag
+
+
+def run(readers: list[str], open_frontend, image: dict, idms: queue.Queue,
+        log: Log) -> float:
+    """
+    Provision cards on all readers until the IDm queue is empty.
+    Returns the elapsed time in seconds.
+    """
+    stop = threading.Event()
+    start = time.perf_counter()
+    threads = [threading.Thread(target=worker,
+                                args=(path, open_frontend, image, idms, log, stop))
+               for path in readers]
+    for t in threads:
+        t.start()
+    try:
+        for t in threads:
+            t.join()
+    except KeyboardInterrupt:
+        # workers stop after the current card
+        stop.set()
+        for t in threads:
+            t.join()
+    return time.perf_counter() - start
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Provision SiliCa cards on all attached readers in parallel.",
+    )
+    parser.add_argument("image", help="card image (JSON), see provision.py")
+    parser.add_argument("--idm-csv", help="CSV file with an 'idm' column")
+    parser.add_argument("--idm-range", nargs=2, metavar=("START", "COUNT"),
+                        help="assign COUNT sequential IDms from START (hex)")
+    parser.add_argument("--log", default="fleet.csv", help="result log (CSV)")
+    parser.add_argument("--mock", type=int, metavar="N",
+                        help="use N readers with natively compiled cards instead of USB readers")
+    args = parser.parse_args(argv[1:])
+
+    try:
+        image = provision.load_image(args.image)
+        used = load_used_idms(args.log)
+        idms = load_idms(args, used)
+    except (OSError, ValueError) as exc:
+        print("Error:", exc)
+        return 1
+
+    if args.mock:
+        readers = [f"mock:{i}" for i in range(args.mock)]
+        open_frontend = MockFrontend
+    else:
+        readers = find_readers()
+        open_frontend = nfc.ContactlessFrontend
+    if not readers:
+        print("No readers found")
+        return 1
+
+    total = idms.qsize()
+    print(f"{len(readers)} readers, {total} IDms to assign")
+
+    log = Log(args.log)
+    elapsed = run(readers, open_frontend, image, idms, log)
+    log.close()
+
+    done = log.done
+    print(f"{done} cards in {elapsed:.1f} s, {3600 * done / elapsed:.0f} cards/hour "
+          f"({3600 * done / elapsed / len(readers):.0f} per reader)")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
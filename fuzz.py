@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+
+# Fuzz the receive and process paths of the natively compiled firmware
+# under AddressSanitizer and UndefinedBehaviorSanitizer
+# (target: src/1_1/host/fuzz.cpp).
+# With clang, the target is built for libFuzzer; otherwise inputs are
+# mutated here and replayed in batches through the standalone driver.
+# The corpus doubles as a throughput benchmark of decode+process.
+# For AFL, build the standalone driver with CXX=afl-clang-fast++ (fuzz.py build).
+# Usage examples:
+# python fuzz.py seeds corpus
+# python fuzz.py run corpus --time 600
+# python fuzz.py minimize corpus corpus.min
+# python fuzz.py bench corpus.min -n 1000
+# python fuzz.py run corpus -D STREAMING_RECEIVE
+# python fuzz.py run corpus -D OTA_UPDATE
+
+import hashlib
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+import argparse
+from pathlib import Path
+
+import native
+from capture import modulate
+
+TARGET = native.FIRMWARE_DIR / "host" / "fuzz.cpp"
+SANITIZE_FLAGS = ("-g", "-fno-omit-frame-pointer", "-fsanitize=address,undefined",
+                  "-fno-sanitize-recover=all")
+LIBFUZZER_FLAGS = ("-DLIBFUZZER", "-fsanitize=fuzzer")
+
+# first byte of an input, fuzz_path_t in fuzz.cpp
+FUZZ_RECEIVE = 0
+FUZZ_PROCESS = 1
+
+# IDm of a blank card, which every input starts from
+IDM = b"\xFF" * 8
+
+
+def has_libfuzzer() -> bool:
+    return "clang" in os.environ.get("CXX", "") or shutil.which("clang++") is not None
+
+
+def build(sanitize: bool = True, libfuzzer: bool = False, defines: tuple[str, ...] = ()) -> Path:
+    if libfuzzer and "CXX" not in os.environ:
+        os.environ["CXX"] = "clang++"
+    flags = (SANITIZE_FLAGS if sanitize else ("-DFUZZ_BENCH",))
+    flags += LIBFUZZER_FLAGS if libfuzzer else ()
+    flags += tuple(f"-D{d}" for d in defines)
+    return native.build(flags, TARGET)
+
+
+def seed_packets() -> list[bytes]:
+    """
+    Valid commands for every supported command code.
+    """
+    def packet(code: int, data: bytes) -> bytes:
+        return bytes([2 + len(data), code]) + data
+
+    def blocks(nums: list[int], three_byte: bool = False) -> bytes:
+        if three_byte:
+            return b"".join(bytes([0x00, n, 0x00]) for n in nums)
+        return b"".join(bytes([0x80, n]) for n in nums)
+
+    packets = [
+        packet(0x00, bytes([0xFF, 0xFF, r, slots])) for r in range(3) for slots in (0, 15)
+    ]
+    packets.append(packet(0x02, IDM + bytes([2, 0x0B, 0x00, 0xFF, 0xFF])))
+    packets.append(packet(0x04, IDM))
+    for nums in ([0], [0xE0, 0xE1], [0x83, 0x84, 0x85], list(range(12)) + [0x83, 0x84, 0x85]):
+        for three_byte in (False, True):
+            packets.append(packet(0x06, IDM + bytes([1, 0xFF, 0xFF, len(nums)])
+                                  + blocks(nums, three_byte)))
+    for nums in ([0], [0x84, 0x85, 0x83], [0x86], list(range(12)) + [0x85]):
+        data = bytes(range(16)) * len(nums)
+        packets.append(packet(0x08, IDM + bytes([1, 0xFF, 0xFF, len(nums)])
+                              + blocks(nums) + data))
+        # with the mode byte for the CRC of the stored blocks
+        packets.append(packet(0x08, IDM + bytes([1, 0xFF, 0xFF, len(nums)])
+                              + blocks(nums) + data + bytes([0x01])))
+    # firmware update service (OTA_UPDATE), pages and the commit block
+    for first in (0, 0x100):
+        nums = list(range(first, first + 12))
+        packets.append(packet(0x08, IDM + bytes([1, 0x09, 0x10, len(nums)])
+                              + b"".join(bytes([0x00, n & 0xFF, n >> 8]) for n in nums)
+                              + bytes(range(16)) * len(nums)))
+    packets.append(packet(0x08, IDM + bytes([1, 0x09, 0x10, 1, 0x00, 0xFF, 0xFF])
+                          + b"SiUp" + bytes([0x00, 0xC0, 0x00, 0x00]) + bytes(8)))
+    packets.append(packet(0x0A, IDM + bytes([0, 0])))
+    packets.append(packet(0x0C, IDM))
+    packets.append(packet(0xF0, bytes([0x00]) + b"echo"))
+    packets.append(packet(0xF0, bytes([0x01]) + bytes(16)))
+    packets.append(packet(0xF0, bytes([0x02])))
+    packets.append(packet(0xF0, bytes([0x03])))
+    packets.append(packet(0xF0, bytes([0x04])))
+    return packets
+
+
+def write_seeds(corpus: Path, seed: int) -> int:
+    rng = random.Random(seed)
+    corpus.mkdir(parents=True, exist_ok=True)
+    inputs = []
+    for p in seed_packets():
+        inputs.append(bytes([FUZZ_PROCESS]) + p)
+        inputs.append(bytes([FUZZ_RECEIVE]) + modulate(p, rng.randrange(8), rng.random() < 0.5))
+    for data in inputs:
+        save_input(corpus, data)
+    return len(inputs)
+
+
+def save_input(directory: Path, data: bytes) -> Path:
+    path = directory / hashlib.sha1(data).hexdigest()
+    path.write_bytes(data)
+    return path
+
+
+def mutate(data: bytes, rng: random.Random) -> bytes:
+    """
+    Simple byte-level mutations, used when libFuzzer is not available.
+    """
+    b = bytearray(data)
+    for _ in range(rng.randint(1, 4)):
+        op = rng.randrange(5)
+        pos = rng.randrange(1, len(b)) if len(b) > 1 else 1
+        if op == 0 and len(b) > 1:
+            b[pos] ^= 1 << rng.randrange(8)  # bit flip
+        elif op == 1 and len(b) > 1:
+            b[pos] = rng.choice([0x00, 0xFF, 0x7F, 0x80, rng.randrange(256)])
+        elif op == 2:
+            b[pos:pos] = bytes(rng.randrange(256) for _ in range(rng.randint(1, 16)))
+        elif op == 3 and len(b) > 2:
+            del b[pos:pos + rng.randint(1, 16)]
+        elif op == 4 and len(b) > 1:
+            b[pos:] = b[pos:][:rng.randrange(len(b) - pos + 1)]  # truncate
+    return bytes(b)
+
+
+def run_driver(binary: Path, files: list[Path]) -> bool:
+    result = subprocess.run([str(binary), *map(str, files)], capture_output=True, text=True)
+    return result.returncode == 0
+
+
+def find_crash(binary: Path, files: list[Path], crashes: Path) -> None:
+    for f in files:
+        result = subprocess.run([str(binary), str(f)], capture_output=True, text=True)
+        if result.returncode != 0:
+            crashes.mkdir(exist_ok=True)
+            path = save_input(crashes, f.read_bytes())
+            print(f"Crash saved to {path}")
+            print(result.stderr)
+            return
+
+
+def run_mutations(corpus: Path, seconds: float, seed: int, crashes: Path,
+                  defines: tuple[str, ...]) -> int:
+    binary = build(sanitize=True, defines=defines)
+    inputs = [p.read_bytes() for p in sorted(corpus.iterdir())]
+    rng = random.Random(seed)
+    total = 0
+    start = time.perf_counter()
+    with tempfile.TemporaryDirectory() as tmp:
+        while time.perf_counter() - start < seconds:
+            batch = [save_input(Path(tmp), mutate(rng.choice(inputs), rng)) for _ in range(500)]
+            total += len(batch)
+            if not run_driver(binary, batch):
+                find_crash(binary, batch, crashes)
+                return 1
+            for path in batch:
+                path.unlink(missing_ok=True)
+    elapsed = time.perf_counter() - start
+    print(f"{total} inputs in {elapsed:.1f} s ({total / elapsed:.0f}/s), no crashes")
+    return 0
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Fuzz the SiliCa receive and process paths on the host.",
+    )
+    sub = parser.add_subparsers(dest="action", required=True)
+    p = sub.add_parser("seeds", help="write a seed corpus of valid commands")
+    p.add_argument("corpus", type=Path)
+    p.add_argument("--seed", type=int, default=1)
+    p = sub.add_parser("build", help="build the fuzz target and print its path")
+    p.add_argument("--no-sanitize", action="store_true")
+    p = sub.add_parser("run", help="fuzz starting from a corpus")
+    p.add_argument("corpus", type=Path)
+    p.add_argument("--time", type=float, default=60, help="seconds")
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--crashes", type=Path, default=Path("crashes"))
+    p = sub.add_parser("minimize", help="merge a corpus into a minimal one (libFuzzer)")
+    p.add_argument("corpus", type=Path)
+    p.add_argument("output", type=Path)
+    p = sub.add_parser("bench", help="replay a corpus without sanitizers and report throughput")
+    p.add_argument("corpus", type=Path)
+    p.add_argument("-n", "--repeat", type=int, default=1000)
+    for p in sub.choices.values():
+        p.add_argument("-D", dest="defines", action="append", default=[],
+                       help="firmware build flag, e.g. -D STREAMING_RECEIVE")
+    args = parser.parse_args(argv[1:])
+    defines = tuple(args.defines)
+
+    if args.action == "seeds":
+        print(f"{write_seeds(args.corpus, args.seed)} seeds written to {args.corpus}")
+        return 0
+
+    if args.action == "build":
+        print(build(sanitize=not args.no_sanitize, libfuzzer=has_libfuzzer(), defines=defines))
+        return 0
+
+    if args.action == "run":
+        if has_libfuzzer():
+            binary = build(sanitize=True, libfuzzer=True, defines=defines)
+            args.crashes.mkdir(exist_ok=True)
+            return subprocess.run([
+                str(binary), str(args.corpus), f"-max_total_time={int(args.time)}",
+                f"-seed={args.seed}", f"-artifact_prefix={args.crashes}/",
+            ]).returncode
+        print("clang++ not found, using the built-in mutator")
+        return run_mutations(args.corpus, args.time, args.seed, args.crashes, defines)
+
+    if args.action == "minimize":
+        if not has_libfuzzer():
+            print("Minimizing needs libFuzzer (clang++)")
+            return 1
+        binary = build(sanitize=True, libfuzzer=True, defines=defines)
+        args.output.mkdir(parents=True, exist_ok=True)
+        return subprocess.run([str(binary), "-merge=1", str(args.output), str(args.corpus)]).returncode
+
+    if args.action == "bench":
+        binary = build(sanitize=False, defines=defines)
+        files = sorted(str(p) for p in args.corpus.iterdir())
+        return subprocess.run([str(binary), "-n", str(args.repeat), *files]).returncode
+
+    return 1
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+
+# Build the hardware independent parts of the SiliCa firmware natively
+# and load them with ctypes, so host tools run the same code as the card.
+# Usage examples:
+# python native.py -DSOME_FLAG
+# python native.py check -DSOME_FLAG
+
+import ctypes
+import hashlib
+import os
+import shutil
+import subprocess
+import sys
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parent
+FIRMWARE_DIR = ROOT / "src" / "1_1"
+BUILD_DIR = ROOT / ".native"
+
+# firmware sources without peripheral access, plus host glue
+SOURCES = [
+    FIRMWARE_DIR / "src" / "frame.cpp",
+    FIRMWARE_DIR / "src" / "main.cpp",
+    FIRMWARE_DIR / "src" / "diagnostics.cpp",
+    FIRMWARE_DIR / "src" / "update.cpp",
+    FIRMWARE_DIR / "host" / "host.cpp",
+]
+INCLUDE_DIRS = [
+    FIRMWARE_DIR / "host",  # replacements for avr-libc headers
+    FIRMWARE_DIR / "src",
+]
+CXXFLAGS = ["-std=gnu++17", "-O2"]
+LIBRARY_FLAGS = ["-shared", "-fPIC"]
+
+# RX_BUF_SIZE in silica.h, the most samples capture_frame() accepts
+RX_BUF_SIZE = 0x220
+
+# flash layout in update.h (OTA_UPDATE)
+FLASH_SIZE = 0x4000
+FLASH_PAGE_SIZE = 64
+BOOT_SIZE = 0x200
+STAGE_START = 0x2000
+HEADER_ADDRESS = FLASH_SIZE - FLASH_PAGE_SIZE
+UPDATE_MAGIC = b"SiUp"
+
+# decode_result_t in silica.h
+DECODE_RESULTS = ["ok", "sync error", "length error", "EDC error"]
+
+
+def build(flags: tuple[str, ...] = (), main: Path | None = None) -> Path:
+    """
+    Compile the firmware sources with extra compiler flags.
+    Returns the path of the shared library, or of an executable when a
+    source file with main() is given, reusing a previous build
+    when neither the sources nor the flags changed.
+    """
+    cxx = os.environ.get("CXX", "c++")
+    sources = SOURCES + ([main] if main else [])
+    kind_flags = [] if main else LIBRARY_FLAGS
+
+    key = hashlib.sha1()
+    key.update(" ".join([cxx, *CXXFLAGS, *kind_flags, *flags]).encode())
+    for path in sources + sorted(p for d in INCLUDE_DIRS for p in d.rglob("*.h")):
+        key.update(path.read_bytes())
+    name = main.stem if main else "silica"
+    output = BUILD_DIR / f"{name}-{key.hexdigest()[:12]}{'' if main else '.so'}"
+
+    if not output.exists():
+        BUILD_DIR.mkdir(exist_ok=True)
+        cmd = [cxx, *CXXFLAGS, *kind_flags, *flags]
+        cmd += [f"-I{d}" for d in INCLUDE_DIRS]
+        cmd += [str(s) for s in sources]
+        cmd += ["-o", str(output)]
+        subprocess.run(cmd, check=True)
+    return output
+
+
+def load(flags: tuple[str, ...] = (), instance: int | None = None) -> ctypes.CDLL:
+    """
+    Build (if needed) and load the firmware library.
+    Libraries loaded with different instance numbers have separate
+    firmware state, like separate cards.
+    """
+    path = build(flags)
+    if instance is not None:
+        # the dynamic loader shares a library loaded twice from the same file
+        copy = path.with_name(f"{path.stem}-{instance}.so")
+        if not copy.exists():
+            shutil.copyfile(path, copy)
+        path = copy
+    lib = ctypes.CDLL(str(path))
+
+    lib.silica_set_verbose.argtypes = [ctypes.c_int]
+    lib.silica_set_verbose.restype = None
+    lib.silica_capture.argtypes = [ctypes.c_char_p, ctypes.c_int]
+    lib.silica_capture.restype = None
+    lib.silica_finish.argtypes = []
+    lib.silica_finish.restype = ctypes.c_int
+    lib.silica_decode.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_char_p]
+    lib.silica_decode.restype = ctypes.c_int
+    lib.silica_crc16.argtypes = [ctypes.c_char_p, ctypes.c_int]
+    lib.silica_crc16.restype = ctypes.c_uint16
+    lib.silica_corrected_errors.argtypes = []
+    lib.silica_corrected_errors.restype = ctypes.c_int
+    lib.silica_eeprom.argtypes = []
+    lib.silica_eeprom.restype = ctypes.POINTER(ctypes.c_uint8)
+    lib.silica_eeprom_size.argtypes = []
+    lib.silica_eeprom_size.restype = ctypes.c_int
+    lib.silica_initialize.argtypes = []
+    lib.silica_initialize.restype = None
+    lib.silica_set_vdd.argtypes = [ctypes.c_int]
+    lib.silica_set_vdd.restype = None
+    lib.silica_time_slot.argtypes = []
+    lib.silica_time_slot.restype = ctypes.c_int
+    lib.silica_process.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+    lib.silica_process.restype = ctypes.c_int
+    lib.silica_encode.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int]
+    lib.silica_encode.restype = ctypes.c_int
+    lib.silica_receive.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_char_p]
+    lib.silica_receive.restype = ctypes.c_int
+    if hasattr(lib, "silica_flash"):
+        # built with -DOTA_UPDATE
+        lib.silica_flash.argtypes = []
+        lib.silica_flash.restype = ctypes.POINTER(ctypes.c_uint8)
+        lib.silica_reset_requested.argtypes = []
+        lib.silica_reset_requested.restype = ctypes.c_int
+
+    return lib
+
+
+def command(lib: ctypes.CDLL, data: bytes) -> bytes:
+    """
+    Process a command (without the length byte) and return the response
+    (without the length byte), or b"" when the card does not answer.
+    """
+    response = ctypes.create_string_buffer(256)
+    length = lib.silica_process(bytes([len(data) + 1]) + data, response)
+    return response.raw[1:length]
+
+
+def write(lib: ctypes.CDLL, idm: bytes, service: int, blocks: list[tuple[int, bytes]]) -> bytes:
+    """
+    Write Without Encryption to one service. Returns the status flags.
+    """
+    data = bytes([0x08]) + idm + bytes([1]) + service.to_bytes(2, "little")
+    data += bytes([len(blocks)]) + b"".join(bytes([0x80, n]) for n, _ in blocks)
+    data += b"".join(d for _, d in blocks)
+    return command(lib, data)[9:11]
+
+
+def read(lib: ctypes.CDLL, idm: bytes, service: int, block_num: int) -> bytes:
+    """
+    Read Without Encryption of one block. Returns the block, or b"" on errors.
+    """
+    data = bytes([0x06]) + idm + bytes([1]) + service.to_bytes(2, "little")
+    data += bytes([1, 0x80, block_num])
+    return command(lib, data)[12:28]
+
+
+def check_partitions(lib: ctypes.CDLL) -> bool:
+    """
+    Provision the IDm of card.json with two system codes, then poll and
+    write each system. System 0 must keep top nibble 0 although the stored
+    IDm starts with 1, otherwise it would take over system 1.
+    """
+    lib.silica_initialize()
+    idm = bytes.fromhex("1122334455667788")
+    blank = command(lib, bytes([0x00, 0xFF, 0xFF, 0x00, 0x00]))[1:9]
+    status = write(lib, blank, 0xFFFF, [
+        (0x84, bytes.fromhex("0B00 0920") + bytes(12)),    # SER_C 000B, 2009
+        (0x85, bytes.fromhex("ABCD 1234") + bytes(12)),    # SYS_C
+        (0x86, bytes.fromhex("0601 6602") + bytes(12)),    # PART: 0-5 000B, 6-11 2009
+        (0x83, idm + bytes.fromhex("0001FFFFFFFFFFFF")),  # D_ID
+    ])
+    if status != b"\x00\x00":
+        print(f"partitions: provisioning failed with {status.hex()}")
+        return False
+
+    ok = True
+    for index, (system, service) in enumerate([(0xABCD, 0x000B), (0x1234, 0x2009)]):
+        polled = command(lib, bytes([0x00]) + system.to_bytes(2, "big") + bytes([0x00, 0x00]))[1:9]
+        expected = bytes([index << 4 | idm[0] & 0x0F]) + idm[1:]
+        status = write(lib, polled, service, [(0, bytes(16))])
+        if polled != expected or status != b"\x00\x00":
+            print(f"partitions: system {system:04X} polled {polled.hex()}, "
+                  f"expected {expected.hex()}, write {service:04X} returned {status.hex()}")
+            ok = False
+    return ok
+
+
+def check_link_errors(lib: ctypes.CDLL) -> bool:
+    """
+    Receive an Echo with one bit inverted after the EDC was computed.
+    The decoder must correct it, and Link errors (F0 04) must count it.
+    """
+    from capture import HEADER, modulate
+
+    def corrected() -> int:
+        return int.from_bytes(command(lib, bytes([0xF0, 0x04]))[2:4], "big")
+
+    if not command(lib, bytes([0xF0, 0x04])):
+        print("link errors: skipped, built without the diagnostic commands")
+        return True
+    before = corrected()
+    echo = bytes([7, 0xF0, 0x00]) + b"echo"
+    raw = bytearray(modulate(echo))
+    raw[2 * (len(HEADER) + 4)] ^= 0xC0  # both chips of the first data bit
+    response = ctypes.create_string_buffer(256)
+    length = lib.silica_receive(bytes(raw), len(raw), response)
+    after = corrected()
+    if response.raw[:length] != echo or after != before + 1:
+        print(f"link errors: echo returned {response.raw[:length].hex()}, "
+              f"corrected errors {before} -> {after}")
+        return False
+    return True
+
+
+def check_layout(lib: ctypes.CDLL) -> bool:
+    """
+    Start from an EEPROM full of stale bytes, as older firmware leaves its
+    last error where PART is now. PART must read as the defaults, and a
+    written PART must survive the next start.
+    """
+    size = lib.silica_eeprom_size()
+    ctypes.memset(lib.silica_eeprom(), 0x06, size)
+    lib.silica_initialize()
+    idm = bytes([0x06] * 8)
+    stale = read(lib, idm, 0xFFFF, 0x86)
+    part = bytes.fromhex("0601 6602") + bytes(12)
+    status = write(lib, idm, 0xFFFF, [(0x86, part)])
+    lib.silica_initialize()
+    kept = read(lib, idm, 0xFFFF, 0x86)
+    ctypes.memset(lib.silica_eeprom(), 0x00, size)
+    if stale != bytes(16) or status != b"\x00\x00" or kept != part:
+        print(f"layout: stale PART read {stale.hex()}, write returned {status.hex()}, "
+              f"PART read {kept.hex()} after restart")
+        return False
+    return True
+
+
+# self-checks of the firmware through its command interface
+CHECKS = [check_layout, check_partitions, check_link_errors]
+
+
+def main(argv):
+    if argv[1:2] == ["check"]:
+        lib = load(tuple(argv[2:]))
+        results = [check(lib) for check in CHECKS]
+        print(f"{sum(results)} of {len(results)} checks passed")
+        return 0 if all(results) else 1
+    print(build(tuple(argv[1:])))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
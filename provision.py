@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+
+# Provision SiliCa cards from a declarative card image in a single session.
+# All blocks, including D_ID, SER_C, SYS_C and PART, are written with multi-block
+# Write Without Encryption commands. The card verifies its EEPROM after writing
+# and returns the CRC of the stored blocks, so no read-back is needed
+# (cards with older firmware are read back instead).
+# Usage examples:
+# python provision.py card.json
+# python provision.py card.json --count 50
+
+import json
+import sys
+import time
+import argparse
+from typing import Optional
+
+import nfc
+
+from capture import crc16
+
+COMMAND_READ = 0x06
+COMMAND_WRITE = 0x08
+DEFAULT_PMM = bytes.fromhex("0001FFFFFFFFFFFF")  # 8 bytes
+BLOCK_MAX = 12  # user blocks
+# blocks per command, limited by the maximum packet length
+READ_BLOCK_MAX = 15
+WRITE_BLOCK_MAX = 13
+# mode byte after the block data of Write Without Encryption:
+# the response carries the CRC16 of the stored blocks
+WRITE_MODE_CRC = 0x01
+MAX_SYSTEM = 4
+MAX_SERVICE = 4
+
+D_ID = 0x83
+SER_C = 0x84
+SYS_C = 0x85
+PART = 0x86  # block partition and services per system code
+
+IMAGE_VERSION = 1
+# system blocks that store only their first 8 bytes, the rest reads as zeros
+SHORT_BLOCKS = (SER_C, SYS_C, PART)
+
+
+def block_list(block_nums: list[int]) -> bytes:
+    """
+    Build a block list of 2-byte block list elements.
+    """
+    return b"".join(bytes([0x80, n]) for n in block_nums)
+
+
+def stored(block_num: int, data: bytes) -> bytes:
+    """
+    Block data as the card reads it back after writing.
+    """
+    if block_num in SHORT_BLOCKS:
+        return data[:8] + bytes(8)
+    return data
+
+
+def no_answer(exc: Exception) -> bool:
+    """
+    Whether a command failed because the card did not answer.
+    """
+    if isinstance(exc, nfc.tag.tt3.Type3TagCommandError):
+        return exc.errno == nfc.tag.TIMEOUT_ERROR
+    return isinstance(exc, nfc.clf.TimeoutError)
+
+
+def write_command(tag: nfc.tag.Tag, chunk: list[tuple[int, bytes]], mode: bytes,
+                  timeout: float) -> bytes:
+    cmd_data = bytes([1, 0xFF, 0xFF, len(chunk)])
+    cmd_data += block_list([n for n, _ in chunk])
+    cmd_data += b"".join(data for _, data in chunk)
+    rsp = tag.send_cmd_recv_rsp(COMMAND_WRITE, cmd_data + mode, timeout)
+
+    for n, data in chunk:
+        if n == D_ID:
+            tag.idm = data[0:8]  # Update IDm if written
+    return rsp
+
+
+def write_blocks(tag: nfc.tag.Tag, blocks: list[tuple[int, bytes]],
+                 timeout: float = 1.0) -> Optional[str]:
+    """
+    Write (block_num, data) pairs, WRITE_BLOCK_MAX blocks per command,
+    each command confirmed by the CRC of the stored blocks.
+    Cards without WRITE_MODE_CRC do not answer the mode byte. After the
+    first such timeout the tag is written without it and read back instead.
+    Returns None on success or an error message.
+    Raises nfc.tag.tt3.Type3TagCommandError on write failure
+    (status 0x70 if the card found its EEPROM differing after writing).
+    """
+    for i in range(0, len(blocks), WRITE_BLOCK_MAX):
+        chunk = blocks[i:i + WRITE_BLOCK_MAX]
+        expected = [stored(n, data) for n, data in chunk]
+
+        if getattr(tag, "write_crc", True):
+            try:
+                rsp = write_command(tag, chunk, bytes([WRITE_MODE_CRC]), timeout)
+                if int.from_bytes(rsp[0:2], "big") != crc16(b"".join(expected)):
+                    return f"CRC mismatch in blocks {' '.join(f'{n:02X}h' for n, _ in chunk)}"
+                continue
+            except (nfc.tag.tt3.Type3TagCommandError, nfc.clf.TimeoutError) as exc:
+                if not no_answer(exc):
+                    raise
+                # an older card rejects the length and writes nothing
+                tag.write_crc = False
+
+        write_command(tag, chunk, b"", timeout)
+        for (n, _), e, s in zip(chunk, expected, read_blocks(tag, [n for n, _ in chunk], timeout)):
+            if s != e:
+                return f"Data mismatch in block {n:#04x}"
+
+    return None
+
+
+def read_blocks(tag: nfc.tag.Tag, block_nums: list[int], timeout: float = 1.0) -> list[bytes]:
+    """
+    Read blocks, READ_BLOCK_MAX blocks per command.
+    Raises nfc.tag.tt3.Type3TagCommandError on read failure.
+    """
+    result = []
+    for i in range(0, len(block_nums), READ_BLOCK_MAX):
+        chunk = block_nums[i:i + READ_BLOCK_MAX]
+        cmd_data = bytes([1, 0xFF, 0xFF, len(chunk)]) + block_list(chunk)
+        data = tag.send_cmd_recv_rsp(COMMAND_READ, cmd_data, timeout)[1:]
+        result += [data[16 * j:16 * (j + 1)] for j in range(len(chunk))]
+    return result
+
+
+def parse_codes(codes: list[str], limit: int, name: str) -> bytes:
+    if not (0 < len(codes) <= limit):
+        raise ValueError(f"{name} must have between 1 and {limit} entries")
+    data = b"".join(bytes.fromhex(c) for c in codes)
+    if len(data) != 2 * len(codes):
+        raise ValueError(f"each {name} entry must be 2 bytes")
+    return data
+
+
+def parse_partitions(image: dict) -> bytes:
+    """
+    Build the PART block: <first << 4 | blocks> <service bit mask> per system code.
+    """
+    partitions = image["partitions"]
+    if len(partitions) > len(image.get("system_codes", [])):
+        raise ValueError("partitions must not outnumber system_codes")
+    services = [c.upper() for c in image.get("service_codes", [])]
+    data = b""
+    for i, p in enumerate(partitions):
+        first, blocks = p.get("first", 0), p.get("blocks", BLOCK_MAX)
+        if not (0 <= first and 0 < blocks and first + blocks <= BLOCK_MAX):
+            raise ValueError(f"partition {i} must lie within blocks 0 to {BLOCK_MAX - 1}")
+        mask = 0
+        for code in p.get("services", []):
+            if code.upper() not in services:
+                raise ValueError(f"service {code} of partition {i} is not in service_codes")
+            mask |= 1 << services.index(code.upper())
+        data += bytes([first << 4 | blocks, mask])
+    return data + bytes(16 - len(data))
+
+
+def load_image(path: str) -> dict:
+    """
+    Load a card image. Returns {"user": [(block_num, data)], "system": [(block_num, data)]}.
+
+    Format (JSON):
+      {
+        "version": 1,
+        "idm": "1122334455667788",
+        "pmm": "0001FFFFFFFFFFFF",              (optional)
+        "system_codes": ["ABCD"],
+        "service_codes": ["000B"],
+        "partitions": [{"first": 0, "blocks": 6, "services": ["000B"]}, ...],
+                                                 (optional, one per system code)
+        "blocks": ["00112233445566778899AABBCCDDEEFF", ...]   (up to 12, block 0 first)
+      }
+    Blocks are numbered across the whole card; a system reads its partition
+    from block 0. Without partitions every system sees all blocks and services.
+    With several system codes, the card answers Polling for system i with i
+    in the top nibble of the IDm, so system 0 answers with nibble 0.
+    """
+    with open(path) as f:
+        image = json.load(f)
+
+    if image.get("version", IMAGE_VERSION) != IMAGE_VERSION:
+        raise ValueError(f"unsupported card image version {image['version']}")
+
+    user = []
+    blocks = image.get("blocks", [])
+    if len(blocks) > BLOCK_MAX:
+        raise ValueError(f"at most {BLOCK_MAX} blocks are supported")
+    for i, block in enumerate(blocks):
+        data = bytes.fromhex(block)
+        if len(data) != 16:
+            raise ValueError(f"block {i} must be exactly 16 bytes")
+        user.append((i, data))
+
+    system = []
+    if "service_codes" in image:
+        codes = parse_codes(image["service_codes"], MAX_SERVICE, "service_codes")
+        # service codes are stored little-endian
+        swapped = b"".join(codes[i:i + 2][::-1] for i in range(0, len(codes), 2))
+        system.append((SER_C, swapped + bytes(16 - len(swapped))))
+    if "system_codes" in image:
+        codes = parse_codes(image["system_codes"], MAX_SYSTEM, "system_codes")
+        system.append((SYS_C, codes + bytes(16 - len(codes))))
+    if "partitions" in image:
+        system.append((PART, parse_partitions(image)))
+    if "idm" in image:
+        idm = bytes.fromhex(image["idm"])
+        pmm = bytes.fromhex(image["pmm"]) if "pmm" in image else DEFAULT_PMM
+        if len(idm) != 8 or len(pmm) != 8:
+            raise ValueError("IDm and PMm must be exactly 8 bytes")
+        # D_ID last, since it changes the IDm the card answers to
+        system.append((D_ID, idm + pmm))
+
+    return {"user": user, "system": system}
+
+
+def provision(tag: nfc.tag.Tag, image: dict, timeout: float = 1.0) -> Optional[str]:
+    """
+    Write a card image, verified by the CRC the card returns for each write.
+    Returns None on success or an error message.
+    """
+    # system blocks last, so D_ID is written in the final command
+    return write_blocks(tag, image["user"] + image["system"], timeout)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Provision SiliCa cards from a card image in a single session per card.",
+    )
+    parser.add_argument("image", help="card image (JSON)")
+    parser.add_argument("-c", "--count", type=int, default=1,
+                        help="number of cards to provision")
+    args = parser.parse_args(argv[1:])
+
+    try:
+        image = load_image(args.image)
+    except (OSError, ValueError) as exc:
+        print("Invalid card image:", exc)
+        return 1
+
+    done = 0
+    failed = 0
+
+    def on_connect(tag):
+        nonlocal done, failed
+        start = time.perf_counter()
+        try:
+            error = provision(tag, image)
+        except nfc.tag.tt3.Type3TagCommandError as exc:
+            error = f"{exc}. The tag might not be a SiliCa."
+        elapsed = time.perf_counter() - start
+
+        if error is None:
+            done += 1
+            print(f"Card {done}: provisioned in {elapsed:.3f} s")
+        else:
+            failed += 1
+            print(f"Card failed after {elapsed:.3f} s: {error}")
+        print("Remove the card")
+        return True  # wait for removal
+
+    try:
+        with nfc.ContactlessFrontend("usb") as clf:
+            start = time.perf_counter()
+            while done < args.count:
+                print("Waiting for a FeliCa...")
+                if not clf.connect(rdwr={"targets": ["212F"], "on-connect": on_connect}):
+                    break  # interrupted
+            elapsed = time.perf_counter() - start
+    except Exception as exc:
+        print("Error:", exc)
+        return 1
+
+    if done:
+        print(f"{done} cards provisioned, {failed} failed, "
+              f"{3600 * done / elapsed:.0f} cards/hour")
+    return 0 if done == args.count else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+
+# Replay a frame corpus recorded by capture.py through the firmware decoder
+# (find_sync_index / extract_byte / crc16) compiled natively, and report
+# decode success rates for each decoder variant.
+# A variant is a name and the compiler flags used to build the firmware.
+# The decode time is split into the work done while the samples arrive
+# (capture) and the work left after the end of the frame (finish), which
+# adds to the response latency; compare -DSTREAMING_RECEIVE against the default.
+# These are host timings: they do not show that stream_push() fits the AVR
+# cycle budget (see silica.h).
+# Usage examples:
+# python replay.py field.slcf
+# python replay.py field.slcf --repeat 1000
+# python replay.py field.slcf --variant baseline= --variant tuned=-DSOME_FLAG
+# python replay.py field.slcf -n 100 --variant buffered= --variant streaming=-DSTREAMING_RECEIVE
+
+import ctypes
+import sys
+import time
+import argparse
+
+import native
+from capture import read_corpus
+
+
+def parse_variant(s: str) -> tuple[str, tuple[str, ...]]:
+    name, _, flags = s.partition("=")
+    return name, tuple(f for f in flags.split(",") if f)
+
+
+def replay(lib: ctypes.CDLL, frames: list[tuple[int, bytes]], repeat: int) -> dict:
+    """
+    Decode every frame `repeat` times.
+    Returns counts per decode result, agreement with the on-card result,
+    the decode throughput and the time per frame spent in each phase.
+    """
+    counts = [0] * len(native.DECODE_RESULTS)
+    agree = 0
+    command = ctypes.create_string_buffer(0x200)
+
+    start = time.perf_counter()
+    for _ in range(repeat):
+        for card_result, raw in frames:
+            result = lib.silica_decode(raw, len(raw), command)
+            counts[result] += 1
+            if result == card_result:
+                agree += 1
+    elapsed = time.perf_counter() - start
+
+    # capture only and capture + finish, the difference is the finish phase
+    captured = [raw for _, raw in frames if len(raw) <= native.RX_BUF_SIZE]
+    start = time.perf_counter()
+    for _ in range(repeat):
+        for raw in captured:
+            lib.silica_capture(raw, len(raw))
+    capture = time.perf_counter() - start
+    start = time.perf_counter()
+    for _ in range(repeat):
+        for raw in captured:
+            lib.silica_capture(raw, len(raw))
+            lib.silica_finish()
+    both = time.perf_counter() - start
+
+    total = len(frames) * repeat
+    n = max(1, len(captured) * repeat)
+    return {
+        "total": total,
+        "counts": counts,
+        "agree": agree,
+        "frames_per_second": total / elapsed if elapsed > 0 else 0.0,
+        "capture_us": 1e6 * capture / n,
+        "finish_us": 1e6 * max(0.0, both - capture) / n,
+    }
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Replay captured frames through the natively compiled decoder.",
+    )
+    parser.add_argument("corpus", nargs="+", help="corpus files from capture.py")
+    parser.add_argument("-n", "--repeat", type=int, default=1,
+                        help="number of passes over the corpus")
+    parser.add_argument("--variant", action="append", type=parse_variant,
+                        help="NAME=FLAG[,FLAG...] (default: the firmware as is)")
+    args = parser.parse_args(argv[1:])
+
+    frames = []
+    for path in args.corpus:
+        with open(path, "rb") as f:
+            frames += list(read_corpus(f))
+    if not frames:
+        print("No frames in corpus")
+        return 1
+
+    print(f"{len(frames)} frames loaded")
+
+    for name, flags in args.variant or [("default", ())]:
+        lib = native.load(flags)
+        stats = replay(lib, frames, args.repeat)
+
+        total = stats["total"]
+        ok = stats["counts"][0]
+        print(f"[{name}] {ok}/{total} decoded ({100 * ok / total:.2f}%), "
+              f"{100 * stats['agree'] / total:.2f}% same as on card, "
+              f"{stats['frames_per_second']:.0f} frames/s, "
+              f"capture {stats['capture_us']:.2f} us + finish {stats['finish_us']:.2f} us per frame")
+        for result, count in zip(native.DECODE_RESULTS[1:], stats["counts"][1:]):
+            if count:
+                print(f"    {result}: {count}")
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+
+# Back up, restore or clone a whole SiliCa card.
+# A snapshot reads all user blocks together with D_ID, SER_C, SYS_C and PART
+# with multi-block reads (two, at READ_BLOCK_MAX blocks per read) and saves
+# them as a card image (see provision.py).
+# Restoring writes the image back with batched writes.
+# Usage examples:
+# python snapshot.py save backup.json
+# python snapshot.py restore backup.json
+# python snapshot.py restore backup.json --keep-idm
+
+import json
+import sys
+import time
+import argparse
+
+import nfc
+
+import provision
+from provision import BLOCK_MAX, D_ID, SER_C, SYS_C, PART, IMAGE_VERSION
+
+
+def split_codes(data: bytes, little_endian: bool = False) -> list[str]:
+    """
+    Split a SER_C or SYS_C block into 2-byte codes, up to the first empty entry.
+    """
+    codes = []
+    for i in range(0, len(data), 2):
+        code = data[i:i + 2]
+        if code == b"\x00\x00":
+            break
+        codes.append((code[::-1] if little_endian else code).hex().upper())
+    return codes
+
+
+def split_partitions(data: bytes, systems: int, service_codes: list[str]) -> list[dict]:
+    """
+    Decode the PART block, an empty list if no system has a partition.
+    """
+    partitions = []
+    for i in range(systems):
+        first, blocks = data[2 * i] >> 4, data[2 * i] & 0x0F
+        if blocks == 0 or first + blocks > BLOCK_MAX:
+            first, blocks = 0, BLOCK_MAX  # whole card
+        mask = data[2 * i + 1]
+        services = [c for j, c in enumerate(service_codes) if mask & (1 << j)]
+        partitions.append({"first": first, "blocks": blocks, "services": services})
+    if all(p["blocks"] == BLOCK_MAX and not p["services"] for p in partitions):
+        return []
+    return partitions
+
+
+def snapshot(tag: nfc.tag.Tag, timeout: float = 1.0) -> dict:
+    """
+    Read the whole card and return it as a card image.
+    Raises nfc.tag.tt3.Type3TagCommandError on read failure.
+    """
+    blocks = provision.read_blocks(
+        tag, list(range(BLOCK_MAX)) + [D_ID, SER_C, SYS_C, PART], timeout)
+    d_id, ser_c, sys_c, part = blocks[BLOCK_MAX:]
+
+    image = {
+        "version": IMAGE_VERSION,
+        "idm": d_id[0:8].hex().upper(),
+        "pmm": d_id[8:16].hex().upper(),
+    }
+    system_codes = split_codes(sys_c[:2 * provision.MAX_SYSTEM])
+    if system_codes:
+        image["system_codes"] = system_codes
+    # service codes are stored little-endian
+    service_codes = split_codes(ser_c[:2 * provision.MAX_SERVICE], little_endian=True)
+    if service_codes:
+        image["service_codes"] = service_codes
+    partitions = split_partitions(part, len(system_codes), service_codes)
+    if partitions:
+        image["partitions"] = partitions
+    image["blocks"] = [b.hex().upper() for b in blocks[:BLOCK_MAX]]
+    return image
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Save a SiliCa card to a card image or restore it from one.",
+    )
+    parser.add_argument("action", choices=["save", "restore"])
+    parser.add_argument("image", help="card image (JSON)")
+    parser.add_argument("--keep-idm", action="store_true",
+                        help="restore without changing the IDm and PMm of the card")
+    args = parser.parse_args(argv[1:])
+
+    if args.action == "restore":
+        try:
+            image = provision.load_image(args.image)
+        except (OSError, ValueError) as exc:
+            print("Invalid card image:", exc)
+            return 1
+        if args.keep_idm:
+            image["system"] = [b for b in image["system"] if b[0] != D_ID]
+
+    with nfc.ContactlessFrontend("usb") as clf:
+        print("Waiting for a FeliCa...")
+        tag = clf.connect(
+            rdwr={"targets": ["212F"], 'on-connect': lambda tag: False})
+        if tag is None:
+            return 1
+        print("Tag found:", tag)
+
+        start = time.perf_counter()
+        try:
+            if args.action == "save":
+                image = snapshot(tag)
+                error = None
+            else:
+                error = provision.provision(tag, image)
+        except nfc.tag.tt3.Type3TagCommandError as exc:
+            error = f"{exc}. The tag might not be a SiliCa."
+        elapsed = time.perf_counter() - start
+
+    if error is not None:
+        print(f"Failed after {elapsed:.3f} s: {error}")
+        return 1
+
+    if args.action == "save":
+        with open(args.image, "w") as f:
+            json.dump(image, f, indent=4)
+            f.write("\n")
+        print(f"Saved to {args.image} in {elapsed:.3f} s")
+    else:
+        print(f"Restored from {args.image} in {elapsed:.3f} s")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
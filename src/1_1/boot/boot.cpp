@@ -0,0 +1,118 @@
+// Bootloader for firmware updates of JIS X 6319-4 compatible card "SiliCa"
+// Installs an image staged and committed by the application (see src/update.h)
+// and starts the application at BOOT_SIZE.
+// Built without startup files to fit in BOOT_SIZE: no vectors, no .data
+// or .bss initialization, so only locals and constants are used.
+
+#include <avr/io.h>
+#include <util/crc16.h>
+#include "../src/update.h"
+
+static const uint8_t *const flash = (const uint8_t *)MAPPED_PROGMEM_START;
+
+// erase and write one page, data is copied through the page buffer
+// data is nullptr to erase only
+static void write_page(uint16_t address, const uint8_t *data)
+{
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEBUFCLR_gc);
+
+    volatile uint8_t *page = (volatile uint8_t *)(MAPPED_PROGMEM_START + address);
+    if (data == nullptr)
+    {
+        // a write to the page buffer selects the page to erase
+        page[0] = 0xFF;
+        _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASE_gc);
+    }
+    else
+    {
+        for (int i = 0; i < FLASH_PAGE_SIZE; i++)
+            page[i] = data[i];
+        _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+    }
+
+    while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm)
+    {
+        // do nothing
+    }
+}
+
+static bool same_page(uint16_t a, uint16_t b)
+{
+    for (int i = 0; i < FLASH_PAGE_SIZE; i++)
+    {
+        if (flash[a + i] != flash[b + i])
+            return false;
+    }
+    return true;
+}
+
+// return the size of a committed image, 0 if there is none
+// the CRC is checked again, the staging area may have changed since the commit
+static uint16_t committed_size()
+{
+    const update_header_t *header = (const update_header_t *)(flash + HEADER_ADDRESS);
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (header->magic[i] != UPDATE_MAGIC[i])
+            return 0;
+    }
+
+    uint16_t size = (header->size[0] << 8) | header->size[1];
+    if (size == 0 || size > IMAGE_MAX)
+        return 0;
+
+    uint16_t crc = 0;
+    for (uint16_t i = 0; i < size; i++)
+        crc = _crc_xmodem_update(crc, flash[STAGE_START + i]);
+    if (crc != ((header->crc[0] << 8) | header->crc[1]))
+        return 0;
+
+    return size;
+}
+
+// copy a committed image to APPCODE and start the application
+extern "C" __attribute__((noreturn, used)) void install()
+{
+    uint16_t size = committed_size();
+    if (size != 0)
+    {
+        for (uint16_t offset = 0; offset < size; offset += FLASH_PAGE_SIZE)
+        {
+            // pages already copied before an interruption are skipped
+            if (same_page(BOOT_SIZE + offset, STAGE_START + offset))
+                continue;
+
+            write_page(BOOT_SIZE + offset, flash + STAGE_START + offset);
+            if (!same_page(BOOT_SIZE + offset, STAGE_START + offset))
+            {
+                // start over, the header is still committed
+                _PROTECTED_WRITE(RSTCTRL.SWRR, RSTCTRL_SWRE_bm);
+            }
+        }
+
+        // the update is complete
+        write_page(HEADER_ADDRESS, nullptr);
+    }
+
+    asm volatile("jmp %0" ::"i"(BOOT_SIZE));
+    __builtin_unreachable();
+}
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// entry point at the reset vector
+// Without startup files nothing prepares the compiled code, so the entry
+// clears the zero register and sets the stack pointer before install().
+// Naked functions may only contain basic asm.
+extern "C" __attribute__((naked, used, section(".vectors"))) void boot()
+{
+    asm volatile(
+        "clr __zero_reg__\n\t"
+        "ldi r28, lo8(" STRINGIFY(RAMEND) ")\n\t"
+        "ldi r29, hi8(" STRINGIFY(RAMEND) ")\n\t"
+        "out __SP_L__, r28\n\t"
+        "out __SP_H__, r29\n\t"
+        "rjmp install");
+}
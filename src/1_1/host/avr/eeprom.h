@@ -0,0 +1,24 @@
+// Host replacement for <avr/eeprom.h> of avr-libc
+// EEMEM variables are collected into one section, which host.cpp
+// exposes as the EEPROM image of the card (with the user row, see host.cpp).
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM __attribute__((section("silica_nvm")))
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+static inline void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+static inline void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    memcpy(dst, src, n);
+}
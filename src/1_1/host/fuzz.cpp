@@ -0,0 +1,205 @@
+// Fuzz target for the SiliCa receive and process paths.
+// Linked with the firmware sources and host.cpp (see fuzz.py).
+// The first byte of an input selects the path:
+//   FUZZ_RECEIVE: the rest is raw samples as capture_frame() stores them,
+//                 decoded and processed like loop() does
+//   FUZZ_PROCESS: the rest is a command packet as decode_frame() produces it,
+//                 held in a buffer of exactly its length so that reads
+//                 beyond the packet are reported by AddressSanitizer
+// Every response is also encoded by both transmit models (see host.cpp),
+// which must produce the same chips; FUZZ_BENCH builds skip this to time
+// decode+process only.
+// Built with -fsanitize=fuzzer this is a libFuzzer target; otherwise
+// main() replays inputs from files (or stdin, for AFL), optionally
+// repeating them to measure throughput.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "silica.h"
+
+enum fuzz_path_t : uint8_t
+{
+    FUZZ_RECEIVE,
+    FUZZ_PROCESS,
+};
+
+extern "C" int silica_encode(const uint8_t *, uint8_t *, int);
+extern "C" void silica_capture(const uint8_t *, int);
+extern "C" int silica_finish();
+
+// arena bytes behind the response buffer must never be written by process()
+static constexpr int RESPONSE_END = RESPONSE_OFFSET + RESPONSE_SIZE;
+static constexpr uint8_t CANARY = 0xA5;
+
+static void check_response(packet_t response)
+{
+    for (int i = RESPONSE_END; i < ARENA_SIZE; i++)
+    {
+        if (arena[i] != CANARY)
+        {
+            fprintf(stderr, "response buffer overflow at arena[%#x]\n", i);
+            abort();
+        }
+    }
+    if (response == nullptr)
+        return;
+    if (response[0] < 2 || response[0] > RESPONSE_SIZE)
+    {
+        fprintf(stderr, "invalid response length %d\n", response[0]);
+        abort();
+    }
+
+#ifndef FUZZ_BENCH
+    // the HARDWARE_MANCHESTER constants must describe the software encoding
+    // (a consistency check of the design, not of the CCL, see encode_hardware())
+    static uint8_t software[2 * (HEADER_SIZE + 0xFF + 2)];
+    static uint8_t hardware[2 * (HEADER_SIZE + 0xFF + 2)];
+    int len = silica_encode(response, software, 0);
+    if (silica_encode(response, hardware, 1) != len || memcmp(software, hardware, len) != 0)
+    {
+        fprintf(stderr, "hardware Manchester encoding differs\n");
+        abort();
+    }
+#endif
+}
+
+static void receive(const uint8_t *data, size_t size)
+{
+    if (size > RX_BUF_SIZE)
+        return;
+
+    // same decode as receive_command()
+    uint8_t *command = arena + COMMAND_OFFSET;
+    silica_capture(data, size);
+    if (silica_finish() != DECODE_OK)
+        return;
+
+    // the buffered decoder only writes the samples' worth of bytes,
+    // so the guard is set after decoding
+    memset(arena + RESPONSE_END, CANARY, ARENA_SIZE - RESPONSE_END);
+    packet_t response = process(command);
+    check_response(response);
+    if (response == nullptr)
+        save_error(command);
+}
+
+static void process_packet(const uint8_t *data, size_t size)
+{
+    // the length byte of a decoded command always matches its size
+    if (size == 0 || size > 0xFF)
+        return;
+
+    uint8_t *command = (uint8_t *)malloc(size);
+    memcpy(command, data, size);
+    command[0] = size;
+
+    memset(arena + RESPONSE_END, CANARY, ARENA_SIZE - RESPONSE_END);
+    packet_t response = process(command);
+    check_response(response);
+    free(command);
+}
+
+// bounds of the EEMEM section, provided by the linker
+extern uint8_t __start_silica_nvm[];
+extern uint8_t __stop_silica_nvm[];
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size == 0)
+        return 0;
+
+    // every input starts from a blank card (IDm FFFFFFFFFFFFFFFF),
+    // so results do not depend on earlier writes
+    memset(__start_silica_nvm, 0xFF, __stop_silica_nvm - __start_silica_nvm);
+    initialize();
+
+    switch (data[0])
+    {
+    case FUZZ_RECEIVE:
+        receive(data + 1, size - 1);
+        break;
+    case FUZZ_PROCESS:
+        process_packet(data + 1, size - 1);
+        break;
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+// Standalone driver
+// Usage: fuzz [-n repeat] [file ...]
+// Reads one input from stdin when no file is given.
+
+static uint8_t *read_file(FILE *f, size_t &size)
+{
+    size_t capacity = 0x400;
+    uint8_t *buf = (uint8_t *)malloc(capacity);
+    size = 0;
+    size_t n;
+    while ((n = fread(buf + size, 1, capacity - size, f)) > 0)
+    {
+        size += n;
+        if (size == capacity)
+            buf = (uint8_t *)realloc(buf, capacity *= 2);
+    }
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    long repeat = 1;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0)
+    {
+        repeat = atol(argv[2]);
+        first = 3;
+    }
+
+    int count = argc - first;
+    if (count == 0)
+    {
+        size_t size;
+        uint8_t *data = read_file(stdin, size);
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+        return 0;
+    }
+
+    uint8_t **inputs = (uint8_t **)malloc(count * sizeof(uint8_t *));
+    size_t *sizes = (size_t *)malloc(count * sizeof(size_t));
+    for (int i = 0; i < count; i++)
+    {
+        FILE *f = fopen(argv[first + i], "rb");
+        if (f == nullptr)
+        {
+            perror(argv[first + i]);
+            return 1;
+        }
+        inputs[i] = read_file(f, sizes[i]);
+        fclose(f);
+    }
+
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long r = 0; r < repeat; r++)
+    {
+        for (int i = 0; i < count; i++)
+            LLVMFuzzerTestOneInput(inputs[i], sizes[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    long execs = repeat * count;
+    printf("%ld inputs in %.3f s, %.0f inputs/s, %.2f us/input\n",
+           execs, seconds, execs / seconds, 1e6 * seconds / execs);
+
+    for (int i = 0; i < count; i++)
+        free(inputs[i]);
+    free(inputs);
+    free(sizes);
+    return 0;
+}
+#endif
@@ -0,0 +1,328 @@
+// Host build glue for SiliCa firmware sources.
+// Compiled together with the hardware independent parts of the
+// firmware into a shared library, which native.py loads with ctypes.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <avr/eeprom.h>
+#include "silica.h"
+#ifdef OTA_UPDATE
+#include "update.h"
+#endif
+
+// bounds of the EEMEM section, provided by the linker
+extern uint8_t __start_silica_nvm[];
+extern uint8_t __stop_silica_nvm[];
+
+static bool verbose = false;
+
+// state of the receive model (silica_capture / silica_finish)
+#ifdef STREAMING_RECEIVE
+static stream_decoder_t decoder;
+#endif
+static int captured_len = 0;
+
+// timing probe stamps, the host has no timer so they stay zero
+uint16_t stamps[STAMP_COUNT] = {};
+bool stamp_response = false;
+
+// deferred tasks run to completion at once, without accounting
+// (serial output is not buffered on the host)
+task_stats_t task_stats[TASK_COUNT] = {};
+
+void defer(task_id_t id)
+{
+    // the host user row is always ready, a step writes one byte
+    // a low supply (silica_set_vdd) leaves the save unfinished
+    if (id == TASK_SAVE_ERROR)
+    {
+        for (int i = 0; i <= USER_ROW_SIZE && !save_error_step(); i++)
+        {
+            // next byte
+        }
+    }
+}
+
+#ifdef OTA_UPDATE
+// flash of the card, erased at start
+static struct flash_t
+{
+    uint8_t data[FLASH_SIZE];
+    flash_t() { memset(data, 0xFF, sizeof(data)); }
+} flash;
+static bool reset_requested = false;
+
+const uint8_t *flash_data(uint16_t address)
+{
+    return flash.data + address;
+}
+
+void flash_write_page(uint16_t address, const uint8_t *data)
+{
+    memcpy(flash.data + address, data, FLASH_PAGE_SIZE);
+}
+
+void request_reset()
+{
+    reset_requested = true;
+}
+#endif
+
+// supply voltage of the card in millivolts (silica_set_vdd)
+static uint16_t vdd_mv = 3300;
+
+// the conversion completes at once
+uint16_t vdd_convert()
+{
+    return vdd_counts(vdd_mv);
+}
+
+bool vdd_above_vlm()
+{
+    return vdd_mv >= VDD_VLM_MV;
+}
+
+// user row of the card, part of the EEPROM image on the host
+static uint8_t EEMEM user_row[USER_ROW_SIZE];
+
+bool user_row_ready()
+{
+    return true;
+}
+
+uint8_t user_row_read(int offset)
+{
+    return user_row[offset];
+}
+
+void user_row_write(int offset, uint8_t data)
+{
+    user_row[offset] = data;
+}
+
+// Serial output goes to stderr when verbose
+void Serial_write(uint8_t data)
+{
+    if (verbose)
+        fputc(data, stderr);
+}
+
+void Serial_print(const char *str)
+{
+    while (*str)
+        Serial_write(*str++);
+}
+
+void Serial_println(const char *str)
+{
+    Serial_print(str);
+    Serial_print("\r\n");
+}
+
+// Transmit models
+// Both return the chips (half-bit levels) of a frame, packed MSB first
+// like the bytes the SPI shifts out in the software encoder.
+
+// software encoder, transmit_byte() without HARDWARE_MANCHESTER
+static int encode_software(const uint8_t *frame, int len, uint8_t *chips)
+{
+    for (int i = 0; i < len; i++)
+    {
+        chips[2 * i] = manchester_table[frame[i] >> 4];
+        chips[2 * i + 1] = manchester_table[frame[i] & 0xF];
+    }
+    return 2 * len;
+}
+
+// output of CCL LUT1 at TCA0 count t while the SPI outputs bit
+static int lut1_output(int bit, int t)
+{
+    int wo1 = t < TX_TCA_CMP;
+    return (TX_MANCHESTER_TRUTH >> (wo1 << 1 | bit)) & 1;
+}
+
+// hardware encoder with HARDWARE_MANCHESTER
+// The SPI shifts one bit per TCA0 period, changing its output at the
+// falling edge of SCK (count TX_TCA_CMP). The LUT output is evaluated at
+// every count of each half bit, so any glitch within a half bit is an error.
+// This restates the firmware's own constants, so it only checks that they
+// are consistent. It models neither the CCL synchronizer and filter delay
+// nor whether WO1 reaches the LUT without CMP1EN; equivalence with the
+// software encoder is unverified until checked on hardware.
+// return 0 if the output is not a clean Manchester code
+static int encode_hardware(const uint8_t *frame, int len, uint8_t *chips)
+{
+    constexpr int PERIOD = TX_TCA_PERIOD + 1;
+    memset(chips, 0, 2 * len);
+
+    for (int i = 0; i < 8 * len; i++)
+    {
+        int bit = (frame[i / 8] >> (7 - i % 8)) & 1;
+        for (int half = 0; half < 2; half++)
+        {
+            int level = lut1_output(bit, (TX_TCA_CMP + half * PERIOD / 2) % PERIOD);
+            for (int k = 1; k < PERIOD / 2; k++)
+            {
+                if (lut1_output(bit, (TX_TCA_CMP + half * PERIOD / 2 + k) % PERIOD) != level)
+                    return 0;
+            }
+            int chip = 2 * i + half;
+            chips[chip / 8] |= level << (7 - chip % 8);
+        }
+    }
+    return 2 * len;
+}
+
+extern "C"
+{
+    void silica_set_verbose(int enable)
+    {
+        verbose = enable;
+    }
+
+    // model of capture_frame(): the work done while the samples arrive
+    // rx_len must not exceed RX_BUF_SIZE
+    void silica_capture(const uint8_t *rx_buf, int rx_len)
+    {
+#ifdef STREAMING_RECEIVE
+        stream_begin(decoder, arena + COMMAND_OFFSET);
+        for (int i = 0; i < rx_len; i++)
+            stream_push(decoder, rx_buf[i]);
+#else
+        memcpy(arena, rx_buf, rx_len);
+#endif
+        captured_len = rx_len;
+    }
+
+    // model of the decode in receive_command(): the work left after the
+    // end of the frame, return decode_result_t
+    // the command is decoded into the arena like on the card
+    int silica_finish()
+    {
+#ifdef STREAMING_RECEIVE
+        return stream_end(decoder);
+#else
+        return decode_frame(arena, captured_len, arena + COMMAND_OFFSET);
+#endif
+    }
+
+    // decode raw samples into command, return decode_result_t
+    int silica_decode(const uint8_t *rx_buf, int rx_len, uint8_t *command)
+    {
+        // the card stops capturing (capture_frame() returns 0)
+        if (rx_len > RX_BUF_SIZE)
+            return DECODE_LENGTH_ERROR;
+
+        silica_capture(rx_buf, rx_len);
+        int result = silica_finish();
+        memcpy(command, arena + COMMAND_OFFSET, COMMAND_SIZE);
+        return result;
+    }
+
+    uint16_t silica_crc16(const uint8_t *buf, int len)
+    {
+        return crc16(buf, len);
+    }
+
+    int silica_corrected_errors()
+    {
+        return corrected_errors;
+    }
+
+    // EEPROM image of the card, including the user row
+    // call silica_initialize() after modifying it
+    uint8_t *silica_eeprom()
+    {
+        return __start_silica_nvm;
+    }
+
+    int silica_eeprom_size()
+    {
+        return __stop_silica_nvm - __start_silica_nvm;
+    }
+
+    void silica_initialize()
+    {
+        initialize();
+    }
+
+    // supply voltage the card measures, to model weak fields
+    void silica_set_vdd(int mv)
+    {
+        vdd_mv = mv;
+    }
+
+    // time slot chosen by the last Polling command
+    int silica_time_slot()
+    {
+        return response_time_slot;
+    }
+
+    // process a command packet, return the length of the response or 0 for no response
+    int silica_process(const uint8_t *command, uint8_t *response)
+    {
+        packet_t result = process(command);
+        if (result == nullptr)
+            return 0;
+
+        memcpy(response, result, result[0]);
+        return result[0];
+    }
+
+    // encode the frame send_response() transmits for a response into chips
+    // hardware selects the HARDWARE_MANCHESTER model
+    // return the number of chip bytes, or 0 if the encoding is broken
+    int silica_encode(const uint8_t *response, uint8_t *chips, int hardware)
+    {
+        uint8_t frame[HEADER_SIZE + 0xFF + 2];
+        int len = response[0];
+        uint16_t edc = crc16(response, len);
+
+        memcpy(frame, header, HEADER_SIZE);
+        memcpy(frame + HEADER_SIZE, response, len);
+        frame[HEADER_SIZE + len] = edc >> 8;
+        frame[HEADER_SIZE + len + 1] = edc & 0xFF;
+
+        int size = HEADER_SIZE + len + 2;
+        if (hardware)
+            return encode_hardware(frame, size, chips);
+        return encode_software(frame, size, chips);
+    }
+
+    // decode raw samples and process the command like loop() does
+    // return the length of the response or 0 for no response
+    int silica_receive(const uint8_t *rx_buf, int rx_len, uint8_t *response)
+    {
+        if (rx_len > RX_BUF_SIZE)
+            return 0;
+
+        // same decode as receive_command()
+        uint8_t *command = arena + COMMAND_OFFSET;
+        silica_capture(rx_buf, rx_len);
+        if (silica_finish() != DECODE_OK)
+            return 0;
+
+        int len = silica_process(command, response);
+        if (len == 0)
+            save_error(command);
+        return len;
+    }
+
+#ifdef OTA_UPDATE
+    // flash image of the card (FLASH_SIZE bytes)
+    uint8_t *silica_flash()
+    {
+        return flash.data;
+    }
+
+    // return whether a reset was requested since the last call
+    // the host has no bootloader, the caller installs the image
+    int silica_reset_requested()
+    {
+        bool requested = reset_requested;
+        reset_requested = false;
+        return requested;
+    }
+#endif
+}
@@ -0,0 +1,17 @@
+// Host replacement for <util/crc16.h> of avr-libc
+#pragma once
+#include <stdint.h>
+
+// same result as the optimized assembler version of avr-libc
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+    crc = crc ^ ((uint16_t)data << 8);
+    for (int i = 0; i < 8; i++)
+    {
+        if (crc & 0x8000)
+            crc = (crc << 1) ^ 0x1021;
+        else
+            crc <<= 1;
+    }
+    return crc;
+}
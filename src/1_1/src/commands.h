@@ -0,0 +1,56 @@
+// Command table for the application layer of
+// JIS X 6319-4 compatible card "SiliCa"
+#pragma once
+#include <stdint.h>
+#include "silica.h"
+
+// command handler
+// return false if the command is not answered
+typedef bool (*handler_t)(packet_t);
+
+// command flags
+constexpr uint8_t COMMAND_IDM = 0x01;       // IDm must match; response code and IDm are set before the handler runs
+constexpr uint8_t COMMAND_EXACT_LEN = 0x02; // length must be exactly len, otherwise at least len
+constexpr uint8_t COMMAND_LOG_ERROR = 0x04; // save and print the command when status flag 1 reports an error
+
+struct command_t
+{
+    uint8_t code;
+    uint8_t len;
+    uint8_t flags;
+    handler_t handler;
+};
+
+// Command sets
+// A command set registers its table entries in its own header by
+// specializing command_set for a slot of its own, e.g.
+//   template <>
+//   struct command_set<COMMAND_SET_DIAGNOSTICS>
+//   {
+//       static constexpr command_t entries[] = {{0xF0, 3, 0, diagnostic}};
+//       static constexpr int count = sizeof(entries) / sizeof(entries[0]);
+//   };
+// main.cpp joins the slots into the command table at compile time, so a
+// set only has to be included below. A slot taken twice does not compile.
+// Entries may share a command code; process() tries them in slot order
+// until a handler answers.
+constexpr int COMMAND_SET_CORE = 0;
+constexpr int COMMAND_SET_MAX = 8;
+
+// empty slot
+template <int slot>
+struct command_set
+{
+    static constexpr const command_t *entries = nullptr;
+    static constexpr int count = 0;
+};
+
+// Optional command sets, enabled with a build flag,
+// e.g. -DSILICA_DIAGNOSTICS=0 to remove the diagnostic commands
+#ifndef SILICA_DIAGNOSTICS
+#define SILICA_DIAGNOSTICS 1
+#endif
+
+#if SILICA_DIAGNOSTICS
+#include "diagnostics.h"
+#endif
@@ -0,0 +1,74 @@
+// Implementation of the diagnostic commands for
+// JIS X 6319-4 compatible card "SiliCa"
+// Command: <len> F0 <subcommand> ...
+
+#include "silica.h"
+#include "commands.h"
+
+#if SILICA_DIAGNOSTICS
+
+// response buffer, shared with the application layer
+static uint8_t *const response = arena + RESPONSE_OFFSET;
+
+bool diagnostic(packet_t command)
+{
+    switch (command[2])
+    {
+    case 0x01: // Timing probe
+        response[0] = 3 + 2 * STAMP_COUNT;
+        response[1] = 0xF1;
+        response[2] = 0x01;
+        // the stamps after process() are filled in by send_response()
+        for (int i = 0; i < STAMP_COUNT; i++)
+        {
+            response[3 + 2 * i] = stamps[i] >> 8;
+            response[4 + 2 * i] = stamps[i] & 0xFF;
+        }
+        stamp_response = true;
+        return true;
+    case 0x02: // Task statistics
+        response[0] = 3 + 10 * TASK_COUNT;
+        response[1] = 0xF1;
+        response[2] = 0x02;
+        for (int i = 0; i < TASK_COUNT; i++)
+        {
+            const task_stats_t &stats = task_stats[i];
+            uint8_t *p = response + 3 + 10 * i;
+            p[0] = stats.steps >> 8;
+            p[1] = stats.steps & 0xFF;
+            p[2] = stats.max_ticks >> 8;
+            p[3] = stats.max_ticks & 0xFF;
+            p[4] = stats.overruns >> 8;
+            p[5] = stats.overruns & 0xFF;
+            p[6] = stats.total_ticks >> 24;
+            p[7] = (stats.total_ticks >> 16) & 0xFF;
+            p[8] = (stats.total_ticks >> 8) & 0xFF;
+            p[9] = stats.total_ticks & 0xFF;
+        }
+        return true;
+    case 0x03: // Supply voltage
+        response[0] = 9;
+        response[1] = 0xF1;
+        response[2] = 0x03;
+        {
+            uint16_t vdd = measure_vdd();
+            response[3] = vdd >> 8;
+            response[4] = vdd & 0xFF;
+        }
+        response[5] = VDD_WRITE_MIN_MV >> 8;
+        response[6] = VDD_WRITE_MIN_MV & 0xFF;
+        response[7] = low_voltage_refusals >> 8;
+        response[8] = low_voltage_refusals & 0xFF;
+        return true;
+    case 0x04: // Link errors
+        response[0] = 5;
+        response[1] = 0xF1;
+        response[2] = 0x04;
+        response[3] = corrected_errors >> 8;
+        response[4] = corrected_errors & 0xFF;
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
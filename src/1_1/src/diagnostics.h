@@ -0,0 +1,24 @@
+// Diagnostic commands (vendor command code 0xF0)
+// 00 Echo:         <len> F0 00 <data>  ->  the command itself (core command, main.cpp)
+// 01 Timing probe: <len> F0 01 [data]  ->  0B F1 01 <frame end> <decoded> <processed> <transmit>
+//                  TCB0 stamps at fc/4 (3.39MHz), 2 bytes each, big-endian
+// 02 Task stats:   <len> F0 02 [data]  ->  <len> F1 02 {<steps> <max> <overruns> <total>} per task_id_t
+//                  2, 2, 2 and 4 bytes, big-endian, times in TCB0 ticks
+// 03 Supply:       <len> F0 03 [data]  ->  09 F1 03 <VDD> <write minimum> <refused writes>
+//                  millivolts and count, 2 bytes each, big-endian
+// 04 Link errors:  <len> F0 04 [data]  ->  05 F1 04 <corrected errors>
+//                  single-bit errors corrected in received frames, 2 bytes, big-endian
+#pragma once
+#include "silica.h"
+#include "commands.h"
+
+bool diagnostic(packet_t);
+
+constexpr int COMMAND_SET_DIAGNOSTICS = 1;
+
+template <>
+struct command_set<COMMAND_SET_DIAGNOSTICS>
+{
+    static constexpr command_t entries[] = {{0xF0, 3, 0, diagnostic}};
+    static constexpr int count = sizeof(entries) / sizeof(entries[0]);
+};
@@ -0,0 +1,464 @@
+// Implementation of the data link layer frame decoder for
+// JIS X 6319-4 compatible card "SiliCa"
+// This file does not touch any peripheral, so it can also be
+// compiled natively on the host (see native.py).
+
+#include <stdint.h>
+#include <util/crc16.h>
+#include "silica.h"
+
+// maximum length of a command including the length byte
+static constexpr int COMMAND_MAX = 0xFF;
+
+// shared buffer for receiving, decoding and responding (see silica.h)
+uint8_t arena[ARENA_SIZE] = {};
+
+// number of single-bit errors corrected so far, for diagnostics
+uint16_t corrected_errors = 0;
+
+const uint8_t header[HEADER_SIZE] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB2, 0x4D};
+
+const uint8_t manchester_table[16] = {0x55, 0x56, 0x59, 0x5A, 0x65, 0x66, 0x69, 0x6A, 0x95, 0x96, 0x99, 0x9A, 0xA5, 0xA6, 0xA9, 0xAA};
+
+// Single-bit error correction
+// CRC16-CCITT is linear, so the syndrome (calculated EDC ^ received EDC)
+// of a single-bit error depends only on the distance d of the flipped bit
+// from the end of the frame: syndrome = x^d mod G.
+// The table holds x^(8k) mod G for every byte offset k of the longest frame,
+// sorted by syndrome. A syndrome is located by dividing it by x up to 7
+// times and searching the table for each candidate.
+struct syndrome_entry_t
+{
+    uint16_t syndrome;
+    uint16_t offset; // bytes from the end of the frame
+};
+
+struct syndrome_table_t
+{
+    syndrome_entry_t entry[COMMAND_MAX + 2];
+};
+
+static constexpr syndrome_table_t make_syndrome_table()
+{
+    syndrome_table_t table = {};
+
+    uint16_t s = 1; // x^0
+    for (int k = 0; k < COMMAND_MAX + 2; k++)
+    {
+        table.entry[k] = {s, (uint16_t)k};
+
+        // multiply by x^8
+        for (int i = 0; i < 8; i++)
+            s = (s & 0x8000) ? (uint16_t)((s << 1) ^ 0x1021) : (uint16_t)(s << 1);
+    }
+
+    // sort by syndrome for binary search
+    for (int i = 1; i < COMMAND_MAX + 2; i++)
+    {
+        syndrome_entry_t e = table.entry[i];
+        int j = i - 1;
+        while (j >= 0 && table.entry[j].syndrome > e.syndrome)
+        {
+            table.entry[j + 1] = table.entry[j];
+            j--;
+        }
+        table.entry[j + 1] = e;
+    }
+
+    return table;
+}
+
+// placed in flash, which is mapped into the data space
+static constexpr syndrome_table_t syndrome_table = make_syndrome_table();
+
+// find the byte offset for a byte aligned syndrome
+// return -1 if not found
+static int find_syndrome(uint16_t syndrome)
+{
+    int lo = 0;
+    int hi = COMMAND_MAX + 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        uint16_t s = syndrome_table.entry[mid].syndrome;
+        if (s == syndrome)
+            return syndrome_table.entry[mid].offset;
+        if (s < syndrome)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+// correct a single-bit error in a frame of len bytes plus EDC
+// return false if the syndrome is not that of a single-bit error
+static bool correct_single_bit(uint8_t *command, int len, uint16_t syndrome)
+{
+    for (int bit = 0; bit < 8; bit++)
+    {
+        int offset = find_syndrome(syndrome);
+        if (offset != -1)
+        {
+            // an error in the length byte cannot be corrected,
+            // since the syndrome was calculated over the wrong range
+            int index = len + 1 - offset;
+            if (index < 1)
+                return false;
+
+            command[index] ^= 1 << bit;
+            return true;
+        }
+
+        // divide by x
+        if (syndrome & 1)
+            syndrome = ((syndrome ^ 0x1021) >> 1) | 0x8000;
+        else
+            syndrome >>= 1;
+    }
+    return false;
+}
+
+// calculate CRC16-CCITT
+uint16_t crc16(const uint8_t *buf, int len)
+{
+    uint16_t crc = 0;
+    for (int i = 0; i < len; i++)
+        crc = _crc_xmodem_update(crc, buf[i]);
+    return crc;
+}
+
+// determine bit shift from sync pattern
+// return -1 if not a valid sync pattern
+int get_shift_from_sync(uint8_t sync1, uint8_t sync2)
+{
+    uint8_t a1 = sync1 & 0xAA;
+    uint8_t b1 = sync1 & 0x55;
+
+    uint8_t a2 = sync2 & 0xAA;
+    uint8_t b2 = sync2 & 0x55;
+
+    if (a1 == 0x8A && a2 == 0x08)
+        return 0;
+    if (b1 == 0x45 && b2 == 0x04)
+        return 1;
+    if (a1 == 0x22 && a2 == 0x82)
+        return 2;
+    if (b1 == 0x11 && b2 == 0x41)
+        return 3;
+    if (a1 == 0x08 && a2 == 0xA0)
+        return 4;
+    if (b1 == 0x04 && b2 == 0x50)
+        return 5;
+    if (a1 == 0x02 && a2 == 0x28)
+        return 6;
+    if (b1 == 0x01 && b2 == 0x14)
+        return 7;
+
+    return -1;
+}
+
+// find sync pattern in received data
+// return index of first sync byte
+int find_sync_index(const uint8_t *rx_buf, int rx_len, int &shift, bool &invert)
+{
+    for (int i = 0; i < rx_len - 1; i++)
+    {
+        int shift1 = get_shift_from_sync(rx_buf[i], rx_buf[i + 1]);
+        int shift2 = get_shift_from_sync(~rx_buf[i], ~rx_buf[i + 1]);
+        if (shift1 != -1 && shift1 > shift2)
+        {
+            shift = shift1;
+            invert = false;
+            return i;
+        }
+        if (shift2 != -1 && shift2 > shift1)
+        {
+            shift = shift2;
+            invert = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// extract one byte from 3 bytes of received data
+// according to the specified bit shift
+uint8_t extract_byte(int shift, uint8_t data1, uint8_t data2, uint8_t data3)
+{
+    uint8_t x = 0;
+
+    if (shift == 0)
+    {
+        if (data1 & 0x80)
+            x |= 0x80;
+        if (data1 & 0x20)
+            x |= 0x40;
+        if (data1 & 0x08)
+            x |= 0x20;
+        if (data1 & 0x02)
+            x |= 0x10;
+        if (data2 & 0x80)
+            x |= 0x08;
+        if (data2 & 0x20)
+            x |= 0x04;
+        if (data2 & 0x08)
+            x |= 0x02;
+        if (data2 & 0x02)
+            x |= 0x01;
+    }
+    if (shift == 1)
+    {
+        if (data1 & 0x40)
+            x |= 0x80;
+        if (data1 & 0x10)
+            x |= 0x40;
+        if (data1 & 0x04)
+            x |= 0x20;
+        if (data1 & 0x01)
+            x |= 0x10;
+        if (data2 & 0x40)
+            x |= 0x08;
+        if (data2 & 0x10)
+            x |= 0x04;
+        if (data2 & 0x04)
+            x |= 0x02;
+        if (data2 & 0x01)
+            x |= 0x01;
+    }
+    if (shift == 2)
+    {
+        if (data1 & 0x20)
+            x |= 0x80;
+        if (data1 & 0x08)
+            x |= 0x40;
+        if (data1 & 0x02)
+            x |= 0x20;
+        if (data2 & 0x80)
+            x |= 0x10;
+        if (data2 & 0x20)
+            x |= 0x08;
+        if (data2 & 0x08)
+            x |= 0x04;
+        if (data2 & 0x02)
+            x |= 0x02;
+        if (data3 & 0x80)
+            x |= 0x01;
+    }
+    if (shift == 3)
+    {
+        if (data1 & 0x10)
+            x |= 0x80;
+        if (data1 & 0x04)
+            x |= 0x40;
+        if (data1 & 0x01)
+            x |= 0x20;
+        if (data2 & 0x40)
+            x |= 0x10;
+        if (data2 & 0x10)
+            x |= 0x08;
+        if (data2 & 0x04)
+            x |= 0x04;
+        if (data2 & 0x01)
+            x |= 0x02;
+        if (data3 & 0x40)
+            x |= 0x01;
+    }
+    if (shift == 4)
+    {
+        if (data1 & 0x08)
+            x |= 0x80;
+        if (data1 & 0x02)
+            x |= 0x40;
+        if (data2 & 0x80)
+            x |= 0x20;
+        if (data2 & 0x20)
+            x |= 0x10;
+        if (data2 & 0x08)
+            x |= 0x08;
+        if (data2 & 0x02)
+            x |= 0x04;
+        if (data3 & 0x80)
+            x |= 0x02;
+        if (data3 & 0x20)
+            x |= 0x01;
+    }
+    if (shift == 5)
+    {
+        if (data1 & 0x04)
+            x |= 0x80;
+        if (data1 & 0x01)
+            x |= 0x40;
+        if (data2 & 0x40)
+            x |= 0x20;
+        if (data2 & 0x10)
+            x |= 0x10;
+        if (data2 & 0x04)
+            x |= 0x08;
+        if (data2 & 0x01)
+            x |= 0x04;
+        if (data3 & 0x40)
+            x |= 0x02;
+        if (data3 & 0x10)
+            x |= 0x01;
+    }
+    if (shift == 6)
+    {
+        if (data1 & 0x02)
+            x |= 0x80;
+        if (data2 & 0x80)
+            x |= 0x40;
+        if (data2 & 0x20)
+            x |= 0x20;
+        if (data2 & 0x08)
+            x |= 0x10;
+        if (data2 & 0x02)
+            x |= 0x08;
+        if (data3 & 0x80)
+            x |= 0x04;
+        if (data3 & 0x20)
+            x |= 0x02;
+        if (data3 & 0x08)
+            x |= 0x01;
+    }
+    if (shift == 7)
+    {
+        if (data1 & 0x01)
+            x |= 0x80;
+        if (data2 & 0x40)
+            x |= 0x40;
+        if (data2 & 0x10)
+            x |= 0x20;
+        if (data2 & 0x04)
+            x |= 0x10;
+        if (data2 & 0x01)
+            x |= 0x08;
+        if (data3 & 0x40)
+            x |= 0x04;
+        if (data3 & 0x10)
+            x |= 0x02;
+        if (data3 & 0x04)
+            x |= 0x01;
+    }
+
+    return x;
+}
+
+// verify the EDC (Error Detection Code) of a command of len bytes
+// and fix a single-bit error in place
+static decode_result_t verify_edc(uint8_t *command, int len, uint16_t calculated_edc)
+{
+    uint16_t received_edc = (command[len] << 8) | command[len + 1];
+    uint16_t syndrome = calculated_edc ^ received_edc;
+
+    if (syndrome != 0)
+    {
+        // the IDm check in process() still rejects frames addressed to another card
+        if (!correct_single_bit(command, len, syndrome))
+            return DECODE_EDC_ERROR;
+
+        corrected_errors++;
+    }
+
+    return DECODE_OK;
+}
+
+// decode captured samples into a command packet
+// command must have room for half of rx_len bytes
+// command may be the same buffer as rx_buf (in-place decode)
+decode_result_t decode_frame(const uint8_t *rx_buf, int rx_len, uint8_t *command)
+{
+    // find sync pattern
+    int shift = -1;
+    bool invert;
+    int rx_index = find_sync_index(rx_buf, rx_len, shift, invert);
+    if (rx_index == -1)
+        return DECODE_SYNC_ERROR;
+
+    // skip sync pattern
+    rx_index += 4;
+
+    // decode data
+    int index = 0;
+    for (int i = rx_index; i < rx_len - 2; i += 2)
+    {
+        uint8_t x = extract_byte(shift, rx_buf[i], rx_buf[i + 1], rx_buf[i + 2]);
+
+        if (invert)
+            x = ~x;
+
+        command[index++] = x;
+    }
+
+    // verify length
+    int len = command[0];
+    if (len + 2 > index)
+        return DECODE_LENGTH_ERROR;
+
+    return verify_edc(command, len, crc16(command, len));
+}
+
+void stream_begin(stream_decoder_t &decoder, uint8_t *command)
+{
+    decoder.command = command;
+    decoder.sample1 = 0x00; // idle level, never part of a sync pattern
+    decoder.shift = -1;
+    decoder.index = 0;
+}
+
+void stream_push(stream_decoder_t &decoder, uint8_t sample)
+{
+    if (decoder.shift == -1)
+    {
+        // same search as find_sync_index(), one sample pair at a time
+        int shift1 = get_shift_from_sync(decoder.sample1, sample);
+        int shift2 = get_shift_from_sync(~decoder.sample1, ~sample);
+        if (shift1 != -1 && shift1 > shift2)
+        {
+            decoder.shift = shift1;
+            decoder.invert = false;
+            decoder.count = 0;
+        }
+        if (shift2 != -1 && shift2 > shift1)
+        {
+            decoder.shift = shift2;
+            decoder.invert = true;
+            decoder.count = 0;
+        }
+    }
+    else if (++decoder.count >= 5 && (decoder.count & 1))
+    {
+        // the data starts 4 samples after the first sync sample,
+        // and each byte spans 3 samples, overlapping by one
+        uint8_t x = extract_byte(decoder.shift, decoder.sample0, decoder.sample1, sample);
+
+        if (decoder.invert)
+            x = ~x;
+
+        int index = decoder.index++;
+        decoder.command[index] = x;
+
+        // EDC of the length byte and the data, up to the length
+        if (index == 0)
+            decoder.edc = 0;
+        if (index < decoder.command[0])
+            decoder.edc = _crc_xmodem_update(decoder.edc, x);
+    }
+
+    decoder.sample0 = decoder.sample1;
+    decoder.sample1 = sample;
+}
+
+decode_result_t stream_end(stream_decoder_t &decoder)
+{
+    if (decoder.shift == -1)
+        return DECODE_SYNC_ERROR;
+
+    // verify length
+    uint8_t *command = decoder.command;
+    int len = command[0];
+    if (decoder.index == 0 || len + 2 > decoder.index)
+        return DECODE_LENGTH_ERROR;
+
+    return verify_edc(command, len, decoder.edc);
+}
@@ -8,7 +8,13 @@ FUSES = {
     .TCD0CFG = FUSE_TCD0CFG_DEFAULT,
     .SYSCFG0 = FUSE_SYSCFG0_DEFAULT | FUSE_EESAVE_bm, // do not erase EEPROM on chip erase
     .SYSCFG1 = SUT_1MS_gc, // 1ms startup time
+#ifdef OTA_UPDATE
+    // BOOT, APPCODE and APPDATA sections in 256-byte units (see update.h)
+    .APPEND = 0x20,
+    .BOOTEND = 0x02,
+#else
     .APPEND = FUSE_APPEND_DEFAULT,
     .BOOTEND = FUSE_BOOTEND_DEFAULT,
+#endif
 };
 #endif
@@ -5,11 +5,24 @@
 #include <string.h>
 #include <avr/eeprom.h>
 #include "silica.h"
+#include "commands.h"
+#ifdef OTA_UPDATE
+#include "update.h"
+#endif
 
 static constexpr int BLOCK_MAX = 12;
+// blocks per command, limited by the maximum packet length
+static constexpr int READ_BLOCK_MAX = 15;  // response: 13 + 16 * n
+static constexpr int WRITE_BLOCK_MAX = 13; // command: 14 + 2 * n + 16 * n (+ 1 mode byte)
 static constexpr int SYSTEM_MAX = 4;
 static constexpr int SERVICE_MAX = 4;
 
+// Write Without Encryption may end with a mode byte after the block data.
+// With WRITE_MODE_CRC, the response carries the CRC16 (big-endian) of the
+// written blocks as Read Without Encryption returns them after the write,
+// so the host can confirm a write without reading it back.
+static constexpr uint8_t WRITE_MODE_CRC = 0x01;
+
 constexpr int LAST_ERROR_SIZE = 2;
 
 static uint8_t idm[8];
@@ -26,10 +39,117 @@ static uint8_t EEMEM system_code_eep[2 * SYSTEM_MAX];
 
 static uint8_t EEMEM block_data_eep[16 * BLOCK_MAX];
 
+// Personalities
+// Each system code has its own block partition and service list, stored in
+// PARTITION_BLOCK as 2 bytes per system, in the order of SYS_C:
+//   <first block << 4 | number of blocks> <bit i set: service i of SER_C>
+// A zero or invalid partition gives all blocks and a zero list all services,
+// so cards without partitions (erased or zeroed) work as before.
+// With several system codes, Polling answers system i with i in the top
+// nibble of IDm (so system 0 with 0, whatever the stored nibble), and
+// process() selects the personality of later commands by that nibble.
+// A card with a single system code keeps its stored IDm.
+// The wildcard service FFFF always addresses the blocks of the whole card.
+static const int PARTITION_BLOCK = 0x86;
+
+struct personality_t
+{
+    uint8_t first;    // first block of the partition in block_data_eep
+    uint8_t count;    // number of blocks
+    uint8_t services; // bit i set: service_code i belongs to the system
+};
+
+static uint8_t partition[2 * SYSTEM_MAX];
+static uint8_t EEMEM partition_eep[2 * SYSTEM_MAX];
+
+// partition_eep and layout_eep hold the last error of older firmware,
+// which EESAVE keeps across reprogramming. Without the magic, PART is
+// reset to the defaults once; cards with personalities must be
+// provisioned again after the update.
+static const uint8_t LAYOUT_MAGIC[4] = {'S', 'i', 'P', '1'};
+static uint8_t EEMEM layout_eep[sizeof(LAYOUT_MAGIC)];
+
+// personality by the top nibble of IDm
+static personality_t personalities[16];
+// personality of the command being processed
+static const personality_t *personality = personalities;
+// view of the wildcard service FFFF, used by the provisioning tools
+static const personality_t whole_card = {0, BLOCK_MAX, (1 << SERVICE_MAX) - 1};
+
+// Polling time slot selection strategies
+#define POLLING_SLOT_FIXED 0  // always answer in slot 0
+#define POLLING_SLOT_RANDOM 1 // pseudo-random slot, seeded from IDm
+#define POLLING_SLOT_IDM 2    // slot derived from IDm
+
+#ifndef POLLING_SLOT_STRATEGY
+#define POLLING_SLOT_STRATEGY POLLING_SLOT_FIXED
+#endif
+
+// time slot of the last Polling response
+uint8_t response_time_slot = 0;
+
+// writes refused for low supply voltage, reported by diagnostics
+uint16_t low_voltage_refusals = 0;
+
+// the last failed command is kept in the user row, the EEPROM is full
 static const int ERROR_BLOCK = 0xE0;
-static uint8_t EEMEM last_error_eep[16 * LAST_ERROR_SIZE];
+static_assert(16 * LAST_ERROR_SIZE <= USER_ROW_SIZE, "last error does not fit in the user row");
+
+// response buffer, placed behind the live command in the shared arena
+static uint8_t *const response = arena + RESPONSE_OFFSET;
+
+// number of system codes in SYS_C
+static int system_count()
+{
+    int n = 0;
+    while (n < SYSTEM_MAX && (system_code[2 * n] != 0 || system_code[2 * n + 1] != 0))
+        n++;
+    return n;
+}
+
+// build the personality table from partition and system codes
+static void update_personalities()
+{
+    personality_t system[SYSTEM_MAX];
+    for (int i = 0; i < SYSTEM_MAX; i++)
+    {
+        int first = partition[2 * i] >> 4;
+        int count = partition[2 * i] & 0x0F;
+        if (count == 0 || first + count > BLOCK_MAX)
+        {
+            first = 0;
+            count = BLOCK_MAX;
+        }
+        uint8_t services = partition[2 * i + 1] & ((1 << SERVICE_MAX) - 1);
+        if (services == 0)
+            services = (1 << SERVICE_MAX) - 1;
+
+        system[i] = {(uint8_t)first, (uint8_t)count, services};
+    }
+
+    for (int n = 0; n < 16; n++)
+        personalities[n] = n < SYSTEM_MAX ? system[n] : system[0];
+    // a single system answers with the stored IDm, whatever its top nibble
+    if (system_count() <= 1)
+        personalities[idm[0] >> 4] = system[0];
+}
+
+uint16_t measure_vdd()
+{
+    uint16_t result = vdd_convert();
+    if (result == 0)
+        return 0xFFFF;
+    return (uint32_t)1100 * 1023 / result;
+}
 
-static uint8_t response[0xFF] = {};
+bool write_supply_ok()
+{
+    if (measure_vdd() >= VDD_WRITE_MIN_MV)
+        return true;
+
+    low_voltage_refusals++;
+    return false;
+}
 
 void initialize()
 {
@@ -38,6 +158,39 @@ void initialize()
     eeprom_read_block(pmm, pmm_eep, 8);
     eeprom_read_block(service_code, service_code_eep, 2 * SERVICE_MAX);
     eeprom_read_block(system_code, system_code_eep, 2 * SYSTEM_MAX);
+    eeprom_read_block(partition, partition_eep, 2 * SYSTEM_MAX);
+
+    uint8_t layout[sizeof(LAYOUT_MAGIC)];
+    eeprom_read_block(layout, layout_eep, sizeof(layout));
+    if (memcmp(layout, LAYOUT_MAGIC, sizeof(layout)) != 0)
+    {
+        // the magic last, so an interrupted reset is repeated
+        memset(partition, 0x00, sizeof(partition));
+        eeprom_update_block(partition, partition_eep, sizeof(partition));
+        eeprom_update_block(LAYOUT_MAGIC, layout_eep, sizeof(layout));
+    }
+    update_personalities();
+}
+
+// select the time slot to answer Polling in
+// n is the number of time slots minus one
+uint8_t select_time_slot(int n)
+{
+#if POLLING_SLOT_STRATEGY == POLLING_SLOT_RANDOM
+    // 16-bit xorshift, seeded from IDm so that cards in one field differ
+    static uint16_t state = 0;
+    if (state == 0)
+        state = crc16(idm, 8) | 1;
+
+    state ^= state << 7;
+    state ^= state >> 9;
+    state ^= state << 8;
+    return state % (n + 1);
+#elif POLLING_SLOT_STRATEGY == POLLING_SLOT_IDM
+    return crc16(idm, 8) % (n + 1);
+#else
+    return 0;
+#endif
 }
 
 bool polling(packet_t command)
@@ -80,13 +233,14 @@ bool polling(packet_t command)
     // response code
     response[1] = 0x01;
 
-    // time slot (unused)
+    // time slot
     int n = command[5];
+    response_time_slot = select_time_slot(n);
 
     memcpy(response + 2, idm, 8);
     memcpy(response + 10, pmm, 8);
 
-    if (system_index > 0)
+    if (system_index > 0 || system_count() > 1)
     {
         // update the top nibble of IDm with the system index
         response[2] = (system_index << 4) | (response[2] & 0x0F);
@@ -109,9 +263,6 @@ bool polling(packet_t command)
 
 bool request_service(packet_t command)
 {
-    if (command[0] < 11)
-        return false;
-
     // number of nodes
     int n = command[10];
     if (!(1 <= n && n <= 32))
@@ -131,18 +282,46 @@ bool request_service(packet_t command)
     return true;
 }
 
-int parse_block_list(int n, const uint8_t *block_list, uint8_t *block_nums)
+bool request_response(packet_t command)
+{
+    response[0] = 11;
+    response[10] = 0x00; // mode
+
+    return true;
+}
+
+// return whether a service belongs to the current personality
+static bool find_service(uint16_t target_service_code)
+{
+    // all services, also avoids bricking cards
+    if (target_service_code == 0xFFFF)
+        return true;
+
+    for (int i = 0; i < SERVICE_MAX; i++)
+    {
+        uint16_t sc = service_code[2 * i] | (service_code[2 * i + 1] << 8);
+        if (sc == 0)
+            break;
+
+        if (target_service_code == sc && (personality->services & (1 << i)))
+            return true;
+    }
+    return false;
+}
+
+// size is the number of bytes available from block_list
+int parse_block_list(int n, const uint8_t *block_list, int size, uint8_t *block_nums)
 {
     int j = 0;
     for (int i = 0; i < n; i++)
     {
-        if (block_list[j] == 0x80)
+        if (j + 2 <= size && block_list[j] == 0x80)
         {
             // 2-byte block list element
             block_nums[i] = block_list[j + 1];
             j += 2;
         }
-        else if (block_list[j] == 0x00)
+        else if (j + 3 <= size && block_list[j] == 0x00)
         {
             // 3-byte block list element
             if (block_list[j + 2] != 0x00)
@@ -159,12 +338,55 @@ int parse_block_list(int n, const uint8_t *block_list, uint8_t *block_nums)
     return j;
 }
 
-bool read_without_encryption(packet_t command)
+// load a block as Read Without Encryption returns it
+// return false if the block does not exist in the view
+static bool load_block(const personality_t *view, int block_num, uint8_t *block_data)
 {
-    // check length
-    if (command[0] < 16)
-        return false;
+    // user blocks of the partition
+    if (block_num < view->count)
+    {
+        eeprom_read_block(block_data, block_data_eep + 16 * (view->first + block_num), 16);
+        return true;
+    }
+    if (ERROR_BLOCK <= block_num && block_num < ERROR_BLOCK + LAST_ERROR_SIZE)
+    {
+        for (int j = 0; j < 16; j++)
+            block_data[j] = user_row_read((block_num - ERROR_BLOCK) * 16 + j);
+        return true;
+    }
+    // D_ID
+    if (block_num == 0x83)
+    {
+        memcpy(block_data, idm, 8);
+        memcpy(block_data + 8, pmm, 8);
+        return true;
+    }
+    // SER_C
+    if (block_num == 0x84)
+    {
+        memcpy(block_data, service_code, 2 * SERVICE_MAX);
+        memset(block_data + 2 * SERVICE_MAX, 0x00, 16 - 2 * SERVICE_MAX);
+        return true;
+    }
+    // SYS_C
+    if (block_num == 0x85)
+    {
+        memcpy(block_data, system_code, 2 * SYSTEM_MAX);
+        memset(block_data + 2 * SYSTEM_MAX, 0x00, 16 - 2 * SYSTEM_MAX);
+        return true;
+    }
+    // partitions
+    if (block_num == PARTITION_BLOCK)
+    {
+        memcpy(block_data, partition, 2 * SYSTEM_MAX);
+        memset(block_data + 2 * SYSTEM_MAX, 0x00, 16 - 2 * SYSTEM_MAX);
+        return true;
+    }
+    return false;
+}
 
+bool read_without_encryption(packet_t command)
+{
     // number of services
     int m = command[10];
 
@@ -182,27 +404,7 @@ bool read_without_encryption(packet_t command)
     // number of blocks
     int n = command[13];
 
-    // find service code
-    bool service_found = false;
-    for (int i = 0; i < SERVICE_MAX; i++)
-    {
-        uint16_t sc = service_code[2 * i] | (service_code[2 * i + 1] << 8);
-        if (sc == 0)
-            break;
-
-        if (target_service_code == sc)
-        {
-            service_found = true;
-            break;
-        }
-    }
-
-    if (target_service_code == 0xFFFF)
-    {
-        service_found = true;
-    }
-
-    if (!service_found)
+    if (!find_service(target_service_code))
     {
         response[0] = 12;    // length
         response[10] = 0xFF; // status flag 1
@@ -211,7 +413,7 @@ bool read_without_encryption(packet_t command)
         return true;
     }
 
-    if (!(1 <= n && n <= BLOCK_MAX))
+    if (!(1 <= n && n <= READ_BLOCK_MAX))
     {
         response[0] = 12;    // length
         response[10] = 0xFF; // status flag 1
@@ -220,8 +422,10 @@ bool read_without_encryption(packet_t command)
         return true;
     }
 
-    uint8_t block_nums[BLOCK_MAX];
-    if (parse_block_list(n, command + 14, block_nums) == 0)
+    const personality_t *view = target_service_code == 0xFFFF ? &whole_card : personality;
+
+    uint8_t block_nums[READ_BLOCK_MAX];
+    if (parse_block_list(n, command + 14, command[0] - 14, block_nums) == 0)
     {
         response[0] = 12;    // length
         response[10] = 0xFF; // status flag 1
@@ -232,43 +436,7 @@ bool read_without_encryption(packet_t command)
     // load block data from EEPROM
     for (int i = 0; i < n; i++)
     {
-        int block_num = block_nums[i];
-
-        bool valid_block = false;
-
-        if (block_num < BLOCK_MAX)
-        {
-            valid_block = true;
-            eeprom_read_block(response + 13 + 16 * i, block_data_eep + 16 * block_num, 16);
-        }
-        if (ERROR_BLOCK <= block_num && block_num < ERROR_BLOCK + LAST_ERROR_SIZE)
-        {
-            valid_block = true;
-            eeprom_read_block(response + 13 + 16 * i, last_error_eep + (block_num - ERROR_BLOCK) * 16, 16);
-        }
-        // D_ID
-        if (n == 1 && block_num == 0x83)
-        {
-            valid_block = true;
-            memcpy(response + 13, idm, 8);
-            memcpy(response + 21, pmm, 8);
-        }
-        // SER_C
-        if (n == 1 && block_num == 0x84)
-        {
-            valid_block = true;
-            memcpy(response + 13, service_code, 2 * SERVICE_MAX);
-            memset(response + 13 + 2 * SERVICE_MAX, 0x00, 16 - 2 * SERVICE_MAX);
-        }
-        // SYS_C
-        if (n == 1 && block_num == 0x85)
-        {
-            valid_block = true;
-            memcpy(response + 13, system_code, 2 * SYSTEM_MAX);
-            memset(response + 13 + 2 * SYSTEM_MAX, 0x00, 16 - 2 * SYSTEM_MAX);
-        }
-
-        if (!valid_block)
+        if (!load_block(view, block_nums[i], response + 13 + 16 * i))
         {
             response[0] = 12;    // length
             response[10] = 0xFF; // status flag 1
@@ -287,6 +455,16 @@ bool read_without_encryption(packet_t command)
     return true;
 }
 
+// write to EEPROM and read the written bytes back (at most 16)
+// return false if the stored content differs
+static bool update_verified(const uint8_t *src, uint8_t *dst, int size)
+{
+    uint8_t stored[16];
+    eeprom_update_block(src, dst, size);
+    eeprom_read_block(stored, dst, size);
+    return memcmp(stored, src, size) == 0;
+}
+
 bool write_without_encryption(packet_t command)
 {
     int len = command[0];
@@ -294,9 +472,6 @@ bool write_without_encryption(packet_t command)
     uint16_t target_service_code = command[11] | (command[12] << 8);
     int n = command[13]; // number of blocks
 
-    if (len < 32)
-        return false;
-
     if (m != 1)
     {
         response[0] = 12;    // length
@@ -306,7 +481,21 @@ bool write_without_encryption(packet_t command)
         return true;
     }
 
-    if (!(1 <= n && n <= BLOCK_MAX))
+#ifdef OTA_UPDATE
+    // firmware image, block numbers and verification differ (see update.h)
+    if (target_service_code == UPDATE_SERVICE_CODE)
+        return update_write(command);
+#endif
+
+    if (!find_service(target_service_code))
+    {
+        response[0] = 12;    // length
+        response[10] = 0xFF; // status flag 1
+        response[11] = 0xA6; // status flag 2
+        return true;
+    }
+
+    if (!(1 <= n && n <= WRITE_BLOCK_MAX))
     {
         response[0] = 12;    // length
         response[10] = 0xFF; // status flag 1
@@ -314,8 +503,11 @@ bool write_without_encryption(packet_t command)
         return true;
     }
 
-    uint8_t block_nums[BLOCK_MAX];
-    int N = parse_block_list(n, command + 14, block_nums);
+    // a copy, D_ID, SYS_C and PART rebuild personalities[] for the next command
+    const personality_t view = target_service_code == 0xFFFF ? whole_card : *personality;
+
+    uint8_t block_nums[WRITE_BLOCK_MAX];
+    int N = parse_block_list(n, command + 14, len - 14, block_nums);
 
     if (N == 0)
     {
@@ -325,53 +517,84 @@ bool write_without_encryption(packet_t command)
         return true;
     }
 
-    // check length
-    if (len != 14 + N + 16 * n)
+    // check length, the mode byte is optional
+    int data_end = 14 + N + 16 * n;
+    if (len != data_end && len != data_end + 1)
+        return false;
+    uint8_t mode = len > data_end ? command[data_end] : 0;
+    if (mode & ~WRITE_MODE_CRC)
         return false;
 
     // write block data to EEPROM
     for (int i = 0; i < n; i++)
     {
+        // measured before every block, which takes milliseconds to write,
+        // so a collapsing supply stops the command between blocks
+        if (!write_supply_ok())
+        {
+            response[0] = 12;                 // length
+            response[10] = 0xFF;              // status flag 1
+            response[11] = LOW_VOLTAGE_ERROR; // status flag 2
+            return true;
+        }
+
         int block_num = block_nums[i];
+        const uint8_t *block_data = command + 14 + N + 16 * i;
 
         bool valid_block = false;
+        bool verified = false;
 
-        if (block_num < BLOCK_MAX)
+        // user blocks of the partition
+        if (block_num < view.count)
         {
             valid_block = true;
-            eeprom_update_block(command + 14 + N + 16 * i, block_data_eep + 16 * block_num, 16);
+            verified = update_verified(block_data, block_data_eep + 16 * (view.first + block_num), 16);
         }
 
         // D_ID
-        if (n == 1 && block_num == 0x83)
+        if (block_num == 0x83)
         {
             valid_block = true;
 
             // Update IDm
-            memcpy(idm, command + 16, 8);
-            eeprom_update_block(idm, idm_eep, 8);
+            memcpy(idm, block_data, 8);
+            verified = update_verified(idm, idm_eep, 8);
 
             // Update PMm
-            memcpy(pmm, command + 24, 8);
-            eeprom_update_block(pmm, pmm_eep, 8);
+            memcpy(pmm, block_data + 8, 8);
+            verified = update_verified(pmm, pmm_eep, 8) && verified;
+
+            // the top nibble of IDm may have changed
+            update_personalities();
         }
 
         // SER_C
-        if (n == 1 && block_num == 0x84)
+        if (block_num == 0x84)
         {
             valid_block = true;
 
-            memcpy(service_code, command + 16, 2 * SERVICE_MAX);
-            eeprom_update_block(service_code, service_code_eep, 2 * SERVICE_MAX);
+            memcpy(service_code, block_data, 2 * SERVICE_MAX);
+            verified = update_verified(service_code, service_code_eep, 2 * SERVICE_MAX);
         }
 
         // SYS_C
-        if (n == 1 && block_num == 0x85)
+        if (block_num == 0x85)
+        {
+            valid_block = true;
+
+            memcpy(system_code, block_data, 2 * SYSTEM_MAX);
+            verified = update_verified(system_code, system_code_eep, 2 * SYSTEM_MAX);
+            update_personalities();
+        }
+
+        // partitions, effective from the next command
+        if (block_num == PARTITION_BLOCK)
         {
             valid_block = true;
 
-            memcpy(system_code, command + 16, 2 * SYSTEM_MAX);
-            eeprom_update_block(system_code, system_code_eep, 2 * SYSTEM_MAX);
+            memcpy(partition, block_data, 2 * SYSTEM_MAX);
+            verified = update_verified(partition, partition_eep, 2 * SYSTEM_MAX);
+            update_personalities();
         }
 
         if (!valid_block)
@@ -381,6 +604,14 @@ bool write_without_encryption(packet_t command)
             response[11] = 0xA8; // status flag 2
             return true;
         }
+
+        if (!verified)
+        {
+            response[0] = 12;            // length
+            response[10] = 0xFF;         // status flag 1
+            response[11] = VERIFY_ERROR; // status flag 2
+            return true;
+        }
     }
 
     response[0] = 12; // length
@@ -388,37 +619,52 @@ bool write_without_encryption(packet_t command)
     response[10] = 0x00; // status flag 1
     response[11] = 0x00; // status flag 2
 
+    if (mode & WRITE_MODE_CRC)
+    {
+        uint8_t *stored = response + 14;
+        for (int i = 0; i < n; i++)
+            load_block(&view, block_nums[i], stored + 16 * i);
+        uint16_t crc = crc16(stored, 16 * n);
+
+        response[0] = 14; // length
+        response[12] = crc >> 8;
+        response[13] = crc & 0xFF;
+    }
+
     return true;
 }
 
-bool search_service_code(int index)
+bool search_service_code(packet_t command)
 {
+    int index = command[10] | (command[11] << 8);
+
     response[0] = 12;
+    response[10] = 0xFF;
+    response[11] = 0xFF;
 
-    if (index < 0 || index >= SERVICE_MAX)
+    // index counts the services of the personality
+    for (int i = 0; i < SERVICE_MAX; i++)
     {
-        response[10] = 0xFF;
-        response[11] = 0xFF;
-        return true;
-    }
+        uint8_t sc1 = service_code[2 * i];
+        uint8_t sc2 = service_code[2 * i + 1];
 
-    uint8_t sc1 = service_code[2 * index];
-    uint8_t sc2 = service_code[2 * index + 1];
+        if (sc1 == 0x00 && sc2 == 0x00)
+            break;
+        if (!(personality->services & (1 << i)))
+            continue;
 
-    if (sc1 == 0x00 && sc2 == 0x00)
-    {
-        response[10] = 0xFF;
-        response[11] = 0xFF;
-        return true;
+        if (index-- == 0)
+        {
+            response[10] = sc1;
+            response[11] = sc2;
+            break;
+        }
     }
 
-    response[10] = sc1;
-    response[11] = sc2;
-
     return true;
 }
 
-bool request_system_code()
+bool request_system_code(packet_t command)
 {
     int n = 0;
 
@@ -440,109 +686,218 @@ bool request_system_code()
     return n != 0;
 }
 
-// process application layer command and generate response
-packet_t process(packet_t command)
+// Echo (vendor command F0 00): answer with the command itself
+// other F0 subcommands are left to the diagnostic commands
+bool echo(packet_t command)
 {
-    if (command == nullptr)
-        return nullptr;
+    if (command[2] != 0x00)
+        return false;
 
-    const int len = command[0];
-    const uint8_t command_code = command[1];
+    memcpy(response, command, command[0]);
+    return true;
+}
 
-    // Polling
-    if (command_code == 0x00)
-    {
-        if (polling(command))
-            return response;
-        else
-            return nullptr;
-    }
+// core commands
+// handlers of commands with COMMAND_IDM only fill in the length and the data
+template <>
+struct command_set<COMMAND_SET_CORE>
+{
+    static constexpr command_t entries[] = {
+        {0x00, 6, 0, polling},
+        {0x02, 11, COMMAND_IDM, request_service},
+        {0x04, 10, COMMAND_IDM | COMMAND_EXACT_LEN, request_response},
+        {0x06, 16, COMMAND_IDM | COMMAND_LOG_ERROR, read_without_encryption},
+        {0x08, 32, COMMAND_IDM, write_without_encryption},
+        {0x0A, 12, COMMAND_IDM | COMMAND_EXACT_LEN, search_service_code},
+        {0x0C, 10, COMMAND_IDM | COMMAND_EXACT_LEN, request_system_code},
+        {0xF0, 3, 0, echo},
+    };
+    static constexpr int count = sizeof(entries) / sizeof(entries[0]);
+};
+
+// number of entries in the slots from slot on
+template <int slot>
+constexpr int command_count()
+{
+    return command_set<slot>::count + command_count<slot + 1>();
+}
+
+template <>
+constexpr int command_count<COMMAND_SET_MAX>()
+{
+    return 0;
+}
 
-    // Echo
-    if (command[1] == 0xF0 && command[2] == 0x00)
+static constexpr int COMMAND_COUNT = command_count<COMMAND_SET_CORE>();
+static_assert(COMMAND_COUNT < 0xFF, "too many commands");
+
+// supported commands, all slots sorted by command code, in slot order
+// for the same code
+struct command_table_t
+{
+    command_t entry[COMMAND_COUNT];
+};
+
+// append the entries of the slots from slot on
+template <int slot>
+constexpr void append_commands(command_table_t &table, int n)
+{
+    for (int i = 0; i < command_set<slot>::count; i++)
+        table.entry[n + i] = command_set<slot>::entries[i];
+    append_commands<slot + 1>(table, n + command_set<slot>::count);
+}
+
+template <>
+constexpr void append_commands<COMMAND_SET_MAX>(command_table_t &, int)
+{
+}
+
+static constexpr command_table_t make_command_table()
+{
+    command_table_t table = {};
+    append_commands<COMMAND_SET_CORE>(table, 0);
+
+    // stable insertion sort by code
+    for (int i = 1; i < COMMAND_COUNT; i++)
     {
-        memcpy(response, command, len);
-        return response;
+        command_t entry = table.entry[i];
+        int j = i;
+        for (; j > 0 && table.entry[j - 1].code > entry.code; j--)
+            table.entry[j] = table.entry[j - 1];
+        table.entry[j] = entry;
     }
+    return table;
+}
 
-    // verify the tail of IDm matches
-    if ((command[2] & 0x0F) != (idm[0] & 0x0F))
-        return nullptr;
-    if (memcmp(command + 3, idm + 1, 7) != 0)
-        return nullptr;
+static constexpr command_table_t command_table = make_command_table();
+static constexpr const command_t *commands = command_table.entry;
 
-    // check command code
-    if (command_code % 2 != 0)
-        return nullptr;
+// command code -> index of its first entry in commands + 1, 0 for
+// unsupported commands
+struct command_index_t
+{
+    uint8_t entry[256];
+};
+
+static constexpr command_index_t make_command_index()
+{
+    command_index_t index = {};
+    for (int i = COMMAND_COUNT - 1; i >= 0; i--)
+        index.entry[commands[i].code] = i + 1;
+    return index;
+}
 
-    // set response code
-    response[1] = command_code + 1;
+static constexpr command_index_t command_index = make_command_index();
 
-    // copy IDm from command to response
-    memcpy(response + 2, command + 2, 8);
+// run one table entry for the command
+// return null if the entry does not answer
+static packet_t run_command(const command_t &entry, packet_t command)
+{
+    const int len = command[0];
 
-    switch (command_code)
+    // check length
+    if (entry.flags & COMMAND_EXACT_LEN ? len != entry.len : len < entry.len)
+        return nullptr;
+
+    if (entry.flags & COMMAND_IDM)
     {
-    case 0x02: // Request Service
-        if (!request_service(command))
+        // verify the tail of IDm matches
+        if ((command[2] & 0x0F) != (idm[0] & 0x0F))
             return nullptr;
-        break;
-    case 0x04: // Request Response
-        if (len != 10)
+        if (memcmp(command + 3, idm + 1, 7) != 0)
             return nullptr;
 
-        response[0] = 11;
-        response[10] = 0x00;
+        // set response code
+        response[1] = entry.code + 1;
 
-        break;
-    case 0x06: // Read Without Encryption
-        if (!read_without_encryption(command))
-            return nullptr;
-        // status flag 1
-        if (response[10] != 0x00)
-        {
-            save_error(command);
-            Serial_println("Read failed");
-            print_packet(command);
-        }
-        break;
-    case 0x08: // Write Without Encryption
-        if (!write_without_encryption(command))
-            return nullptr;
-        break;
-    case 0x0A: // Search Service Code
-    {
-        // Define in switch is prohibited in C++
-        // use a block here
-        if (len != 12)
-            return nullptr;
+        // copy IDm from command to response
+        memcpy(response + 2, command + 2, 8);
 
-        int index = command[10] | (command[11] << 8);
-        search_service_code(index);
+        // the top nibble of IDm selects the system (see polling())
+        personality = &personalities[command[2] >> 4];
     }
-    break;
-    case 0x0C: // Request System Code
-        if (len != 10)
-            return nullptr;
-        if (!request_system_code())
-            return nullptr;
-        break;
-    case 0x10: // Authentication1
-    // pass through for unsupported commands
-    default:
+
+    if (!entry.handler(command))
         return nullptr;
+
+    // status flag 1
+    if (entry.flags & COMMAND_LOG_ERROR && response[10] != 0x00)
+    {
+        save_error(command);
+        // message of the original read handler, Read is the only logged command
+        Serial_println("Read failed");
+        print_packet(command);
     }
 
     return response;
 }
 
+// process application layer command and generate response
+packet_t process(packet_t command)
+{
+    if (command == nullptr)
+        return nullptr;
+
+    // a packet holds at least the length and the command code
+    const int len = command[0];
+    if (len < 2)
+        return nullptr;
+    const uint8_t command_code = command[1];
+
+    // Authentication1 (0x10) and others pass through as unsupported commands
+    int i = command_index.entry[command_code];
+    if (i == 0)
+        return nullptr;
+
+    for (i--; i < COMMAND_COUNT && commands[i].code == command_code; i++)
+    {
+        packet_t result = run_command(commands[i], command);
+        if (result != nullptr)
+            return result;
+    }
+    return nullptr;
+}
+
+// last failed command, written to the user row by save_error_step()
+static uint8_t last_error[16 * LAST_ERROR_SIZE];
+static uint8_t last_error_len = 0;
+static uint8_t last_error_index = 0;
+
 void save_error(packet_t command)
 {
     int len = command[0];
-    if (len > sizeof(last_error_eep))
-        len = sizeof(last_error_eep);
+    if (len > sizeof(last_error))
+        len = sizeof(last_error);
+
+    // a user row write takes milliseconds per byte, too long for the
+    // response time, so it is deferred to the gaps between frames
+    memcpy(last_error, command, len);
+    last_error_len = len;
+    last_error_index = 0;
+    defer(TASK_SAVE_ERROR);
+}
+
+// compare one byte and start its write if it changed
+// return true when the whole command is written
+// The supply is checked before every byte with the VLM, since an ADC
+// conversion is longer than a step. A low supply is retried in a later
+// gap, hopefully with a stronger field, and is not counted as a refused
+// write.
+bool save_error_step()
+{
+    if (last_error_index >= last_error_len)
+        return true;
+    if (!user_row_ready())
+        return false;
+
+    if (!vdd_above_vlm())
+        return false;
+
+    int i = last_error_index++;
+    if (user_row_read(i) != last_error[i])
+        user_row_write(i, last_error[i]);
 
-    eeprom_update_block(command, last_error_eep, len);
+    return last_error_index >= last_error_len;
 }
 
 // Debug: print packet to serial
@@ -5,26 +5,156 @@
 #include <stdint.h>
 #include <string.h>
 #include <avr/io.h>
-#include <util/crc16.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 #include "silica.h"
+#ifdef OTA_UPDATE
+#include "update.h"
+#endif
+
+// buffers for receiving data and command processing, in the shared arena
+#ifdef STREAMING_RECEIVE
+static stream_decoder_t decoder;
+#else
+static uint8_t *const rx_buf = arena;
+#endif
+static uint8_t *const command = arena + COMMAND_OFFSET;
+
+// TCB0 runs freely at fc/4 (3.39MHz) in both clock modes
+// Polling response is sent 2.5ms after the end of the command,
+// plus 1.2083ms for each time slot
+static constexpr uint16_t POLLING_DELAY_TICKS = 8475;
+static constexpr uint16_t TIME_SLOT_TICKS = 4096;
+
+// timer stamps of the current command (see silica.h)
+uint16_t stamps[STAMP_COUNT] = {};
+bool stamp_response = false;
+
+// current clock mode (see set_fast_clock)
+static bool fast_clock = false;
+
+#ifdef OTA_UPDATE
+// set by request_reset(), the card resets after sending the response
+static bool reset_requested = false;
+#endif
+
+#ifdef CAPTURE_FRAMES
+// raw frame kept for dump_frame()
+static int captured_len = 0;
+static uint8_t captured_result = DECODE_OK;
+#endif
+
+// Deferred tasks (see silica.h)
+// A step started while the line is idle delays reading the SPI by at most
+// IDLE_STEP_TICKS. A frame starting meanwhile only loses preamble samples:
+// the SPI buffers keep the oldest samples, and TASK_RESUME_BYTES more bytes
+// are read before the next step, so the sync pattern after the 48-bit
+// preamble (12 SPI bytes, 768 ticks) is always captured. capture_frame()
+// is never delayed, as steps only run inside it or while waiting for a
+// Polling time slot.
+static constexpr uint16_t IDLE_STEP_TICKS = 384;
+static constexpr int8_t TASK_RESUME_BYTES = 4;
+
+static bool serial_step();
+
+struct task_t
+{
+    bool (*step)();  // return true when the task is done
+    uint16_t budget; // worst-case ticks of a step
+};
 
-// data link layer header
-static const uint8_t header[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB2, 0x4D};
+static const task_t tasks[TASK_COUNT] = {
+    {serial_step, 64},
+    {save_error_step, 128}, // checks the VLM, never waits for the ADC
+};
 
-// buffer for receiving data and command processing
-static uint8_t rx_buf[0x220] = {};
-static uint8_t command[0x110] = {};
+static uint8_t pending_tasks = 0; // bit per task_id_t
+task_stats_t task_stats[TASK_COUNT] = {};
+
+void defer(task_id_t id)
+{
+    pending_tasks |= 1 << id;
+}
+
+// run a step of the first pending task whose budget ends before deadline
+// return false if no step was run
+static bool run_task(uint16_t deadline)
+{
+    uint16_t start = TCB0.CNT;
+    for (int id = 0; id < TASK_COUNT; id++)
+    {
+        if (!(pending_tasks & (1 << id)))
+            continue;
+        if ((int16_t)(deadline - start) < (int16_t)tasks[id].budget)
+            continue;
+
+        bool done = tasks[id].step();
+        uint16_t ticks = TCB0.CNT - start;
+
+        task_stats_t &stats = task_stats[id];
+        stats.steps++;
+        stats.total_ticks += ticks;
+        if (ticks > stats.max_ticks)
+            stats.max_ticks = ticks;
+        if (ticks > tasks[id].budget)
+            stats.overruns++;
+
+        if (done)
+            pending_tasks &= ~(1 << id);
+        return true;
+    }
+    return false;
+}
 
 // Functions for serial output.
-// These functions perform blocking writes.
-void Serial_write(uint8_t data)
+// Output is buffered and sent by TASK_SERIAL in the gaps between frames;
+// a write blocks only while the buffer is full. The buffer holds the longest
+// error message ("Unsupported command\r\n", 21 bytes); packet dumps block
+// for their remainder, which only happens on errors.
+static constexpr uint8_t SERIAL_BUFFER_SIZE = 32; // power of 2
+static uint8_t serial_buffer[SERIAL_BUFFER_SIZE];
+static uint8_t serial_head = 0; // next byte to send
+static uint8_t serial_count = 0;
+static bool serial_sent = false; // TXCIF is meaningful after the first byte
+
+// send the oldest buffered byte if the USART accepts it
+static bool serial_send()
+{
+    if (serial_count == 0 || !(USART0.STATUS & USART_DREIF_bm))
+        return false;
+
+    USART0.STATUS = USART_TXCIF_bm;
+    USART0.TXDATAL = serial_buffer[serial_head];
+    serial_sent = true;
+    serial_head = (serial_head + 1) % SERIAL_BUFFER_SIZE;
+    serial_count--;
+    return true;
+}
+
+// return whether the last byte has left the USART
+static bool serial_idle()
 {
-    while (!(USART0.STATUS & USART_DREIF_bm))
+    return serial_count == 0 && (!serial_sent || (USART0.STATUS & USART_TXCIF_bm));
+}
+
+// fill the USART buffer (2 bytes)
+static bool serial_step()
+{
+    while (serial_send())
     {
-        // do nothing
+        // send more
     }
-    USART0.TXDATAL = data;
+    return serial_count == 0;
+}
+
+void Serial_write(uint8_t data)
+{
+    while (serial_count == SERIAL_BUFFER_SIZE)
+        serial_send();
+
+    serial_buffer[(serial_head + serial_count) % SERIAL_BUFFER_SIZE] = data;
+    serial_count++;
+    defer(TASK_SERIAL);
 }
 
 void Serial_print(const char *str)
@@ -51,32 +181,96 @@ uint8_t SPI_transfer(uint8_t data = 0)
     return SPI0.DATA;
 }
 
-// calculate CRC16-CCITT
-uint16_t crc16(const uint8_t *buf, int len)
+// Switch the main clock between fc/4 (3.39MHz) for the RF front end and
+// fc/2 (6.78MHz) for decoding and command processing.
+// TCA0, TCB0 and USART0 are rescaled, so SCK (fc/32), the timer tick and
+// the baud rate stay the same. The buffered TCA0 registers take effect at
+// the next update, so the counter never runs past a shortened period.
+// 6.78MHz needs VDD >= 2.12V (linear between 5MHz@1.8V and 10MHz@2.7V),
+// so the fast clock is only used while VDD is above the VLM level (2.25V).
+// The clock and BAUD cannot change at once, so they only change while the
+// USART is idle: the fast clock is skipped while output is pending, and the
+// slow clock waits for it (at most SERIAL_BUFFER_SIZE bytes, after errors).
+// Neither the latency gain nor the power budget has been measured on a card,
+// so the fast clock is only built with FAST_CLOCK (env:ATtiny1616_fastclock).
+void set_fast_clock(bool fast)
 {
-    uint16_t crc = 0;
-    for (int i = 0; i < len; i++)
-        crc = _crc_xmodem_update(crc, buf[i]);
-    return crc;
+#ifndef FAST_CLOCK
+    fast = false;
+#endif
+    if (fast && !vdd_above_vlm())
+        fast = false;
+    if (fast && !serial_idle())
+        fast = false;
+    if (fast == fast_clock)
+        return;
+
+    while (!serial_idle())
+        serial_send();
+    fast_clock = fast;
+
+    if (fast)
+    {
+        _PROTECTED_WRITE(CLKCTRL.MCLKCTRLB, CLKCTRL_PDIV_2X_gc | CLKCTRL_ENABLE_bm);
+        TCA0.SINGLE.PERBUF = 15;
+        TCA0.SINGLE.CMP0BUF = 7;
+        TCA0.SINGLE.CMP2BUF = 11;
+        TCB0.CTRLA = TCB_CLKSEL_CLKDIV2_gc | TCB_ENABLE_bm;
+        USART0.BAUD = 236;
+    }
+    else
+    {
+        _PROTECTED_WRITE(CLKCTRL.MCLKCTRLB, CLKCTRL_PDIV_4X_gc | CLKCTRL_ENABLE_bm);
+        TCA0.SINGLE.PERBUF = 7;
+        TCA0.SINGLE.CMP0BUF = 3;
+        TCA0.SINGLE.CMP2BUF = 5;
+        TCB0.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
+        USART0.BAUD = 118;
+    }
 }
 
 // capture frame from SPI
 // return length of captured data
 int capture_frame()
 {
+    // the RF front end is timed for the slow clock
+    set_fast_clock(false);
+
+#ifdef STREAMING_RECEIVE
+    // decode while capturing, one SPI byte arrives every 64 CPU cycles
+    stream_begin(decoder, command);
+#endif
+
+    // SPI bytes left to read before the next deferred step
+    int8_t resume = 0;
+
     // wait for start of frame
-    for (int i = 0; i < sizeof(rx_buf); i++)
+    for (int i = 0; i < RX_BUF_SIZE; i++)
     {
         uint8_t data = SPI_transfer();
+#ifdef STREAMING_RECEIVE
+        stream_push(decoder, data);
+#else
         rx_buf[i] = data;
+#endif
 
         // end of frame
         if (data == 0x00 || data == 0xFF)
         {
             // frame too short
-            if (i < sizeof(header) * 2)
+            if (i < HEADER_SIZE * 2)
             {
+                // idle line, time for a deferred step
+                if (i == 0 && pending_tasks && --resume < 0)
+                {
+                    run_task(TCB0.CNT + IDLE_STEP_TICKS);
+                    resume = TASK_RESUME_BYTES;
+                }
+
                 i = -1;
+#ifdef STREAMING_RECEIVE
+                stream_begin(decoder, command);
+#endif
                 continue;
             }
             else
@@ -89,6 +283,7 @@ int capture_frame()
     return 0;
 }
 
+#ifndef STREAMING_RECEIVE
 // Debug: print captured frame to serial
 void print_frame(int rx_len)
 {
@@ -102,222 +297,32 @@ void print_frame(int rx_len)
     }
     Serial_println("");
 }
+#endif
 
-// determine bit shift from sync pattern
-// return -1 if not a valid sync pattern
-int get_shift_from_sync(uint8_t sync1, uint8_t sync2)
+#ifdef CAPTURE_FRAMES
+// Capture: stream the last raw frame to serial in binary form
+// record: A5 5A <result> <length (2 bytes)> <raw data> <CRC16 of raw data (2 bytes)>
+// All multi-byte fields are big-endian. capture.py parses these records.
+void dump_frame()
 {
-    uint8_t a1 = sync1 & 0xAA;
-    uint8_t b1 = sync1 & 0x55;
-
-    uint8_t a2 = sync2 & 0xAA;
-    uint8_t b2 = sync2 & 0x55;
-
-    if (a1 == 0x8A && a2 == 0x08)
-        return 0;
-    if (b1 == 0x45 && b2 == 0x04)
-        return 1;
-    if (a1 == 0x22 && a2 == 0x82)
-        return 2;
-    if (b1 == 0x11 && b2 == 0x41)
-        return 3;
-    if (a1 == 0x08 && a2 == 0xA0)
-        return 4;
-    if (b1 == 0x04 && b2 == 0x50)
-        return 5;
-    if (a1 == 0x02 && a2 == 0x28)
-        return 6;
-    if (b1 == 0x01 && b2 == 0x14)
-        return 7;
-
-    return -1;
-}
+    if (captured_len == 0)
+        return;
 
-// find sync pattern in received data
-// return index of first sync byte
-int find_sync_index(int rx_len, int &shift, bool &invert)
-{
-    for (int i = 0; i < rx_len - 1; i++)
-    {
-        int shift1 = get_shift_from_sync(rx_buf[i], rx_buf[i + 1]);
-        int shift2 = get_shift_from_sync(~rx_buf[i], ~rx_buf[i + 1]);
-        if (shift1 != -1 && shift1 > shift2)
-        {
-            shift = shift1;
-            invert = false;
-            return i;
-        }
-        if (shift2 != -1 && shift2 > shift1)
-        {
-            shift = shift2;
-            invert = true;
-            return i;
-        }
-    }
-    return -1;
-}
+    uint16_t crc = crc16(rx_buf, captured_len);
 
-// extract one byte from 3 bytes of received data
-// according to the specified bit shift
-uint8_t extract_byte(int shift, uint8_t data1, uint8_t data2, uint8_t data3)
-{
-    uint8_t x = 0;
+    Serial_write(0xA5);
+    Serial_write(0x5A);
+    Serial_write(captured_result);
+    Serial_write(captured_len >> 8);
+    Serial_write(captured_len & 0xFF);
+    for (int i = 0; i < captured_len; i++)
+        Serial_write(rx_buf[i]);
+    Serial_write(crc >> 8);
+    Serial_write(crc & 0xFF);
 
-    if (shift == 0)
-    {
-        if (data1 & 0x80)
-            x |= 0x80;
-        if (data1 & 0x20)
-            x |= 0x40;
-        if (data1 & 0x08)
-            x |= 0x20;
-        if (data1 & 0x02)
-            x |= 0x10;
-        if (data2 & 0x80)
-            x |= 0x08;
-        if (data2 & 0x20)
-            x |= 0x04;
-        if (data2 & 0x08)
-            x |= 0x02;
-        if (data2 & 0x02)
-            x |= 0x01;
-    }
-    if (shift == 1)
-    {
-        if (data1 & 0x40)
-            x |= 0x80;
-        if (data1 & 0x10)
-            x |= 0x40;
-        if (data1 & 0x04)
-            x |= 0x20;
-        if (data1 & 0x01)
-            x |= 0x10;
-        if (data2 & 0x40)
-            x |= 0x08;
-        if (data2 & 0x10)
-            x |= 0x04;
-        if (data2 & 0x04)
-            x |= 0x02;
-        if (data2 & 0x01)
-            x |= 0x01;
-    }
-    if (shift == 2)
-    {
-        if (data1 & 0x20)
-            x |= 0x80;
-        if (data1 & 0x08)
-            x |= 0x40;
-        if (data1 & 0x02)
-            x |= 0x20;
-        if (data2 & 0x80)
-            x |= 0x10;
-        if (data2 & 0x20)
-            x |= 0x08;
-        if (data2 & 0x08)
-            x |= 0x04;
-        if (data2 & 0x02)
-            x |= 0x02;
-        if (data3 & 0x80)
-            x |= 0x01;
-    }
-    if (shift == 3)
-    {
-        if (data1 & 0x10)
-            x |= 0x80;
-        if (data1 & 0x04)
-            x |= 0x40;
-        if (data1 & 0x01)
-            x |= 0x20;
-        if (data2 & 0x40)
-            x |= 0x10;
-        if (data2 & 0x10)
-            x |= 0x08;
-        if (data2 & 0x04)
-            x |= 0x04;
-        if (data2 & 0x01)
-            x |= 0x02;
-        if (data3 & 0x40)
-            x |= 0x01;
-    }
-    if (shift == 4)
-    {
-        if (data1 & 0x08)
-            x |= 0x80;
-        if (data1 & 0x02)
-            x |= 0x40;
-        if (data2 & 0x80)
-            x |= 0x20;
-        if (data2 & 0x20)
-            x |= 0x10;
-        if (data2 & 0x08)
-            x |= 0x08;
-        if (data2 & 0x02)
-            x |= 0x04;
-        if (data3 & 0x80)
-            x |= 0x02;
-        if (data3 & 0x20)
-            x |= 0x01;
-    }
-    if (shift == 5)
-    {
-        if (data1 & 0x04)
-            x |= 0x80;
-        if (data1 & 0x01)
-            x |= 0x40;
-        if (data2 & 0x40)
-            x |= 0x20;
-        if (data2 & 0x10)
-            x |= 0x10;
-        if (data2 & 0x04)
-            x |= 0x08;
-        if (data2 & 0x01)
-            x |= 0x04;
-        if (data3 & 0x40)
-            x |= 0x02;
-        if (data3 & 0x10)
-            x |= 0x01;
-    }
-    if (shift == 6)
-    {
-        if (data1 & 0x02)
-            x |= 0x80;
-        if (data2 & 0x80)
-            x |= 0x40;
-        if (data2 & 0x20)
-            x |= 0x20;
-        if (data2 & 0x08)
-            x |= 0x10;
-        if (data2 & 0x02)
-            x |= 0x08;
-        if (data3 & 0x80)
-            x |= 0x04;
-        if (data3 & 0x20)
-            x |= 0x02;
-        if (data3 & 0x08)
-            x |= 0x01;
-    }
-    if (shift == 7)
-    {
-        if (data1 & 0x01)
-            x |= 0x80;
-        if (data2 & 0x40)
-            x |= 0x40;
-        if (data2 & 0x10)
-            x |= 0x20;
-        if (data2 & 0x04)
-            x |= 0x10;
-        if (data2 & 0x01)
-            x |= 0x08;
-        if (data3 & 0x40)
-            x |= 0x04;
-        if (data3 & 0x10)
-            x |= 0x02;
-        if (data3 & 0x04)
-            x |= 0x01;
-    }
-
-    return x;
+    captured_len = 0;
 }
+#endif
 
 // receive command packet from the reader
 // return null if error
@@ -325,57 +330,49 @@ packet_t receive_command()
 {
     // capture frame
     int rx_len = capture_frame();
+    stamps[STAMP_FRAME_END] = TCB0.CNT;
+
+    // decode and process at the fast clock
+    set_fast_clock(true);
+
     if (rx_len == 0)
     {
         Serial_println("Frame capture error");
         return nullptr;
     }
 
-    // find sync pattern
-    int shift = -1;
-    bool invert;
-    int rx_index = find_sync_index(rx_len, shift, invert);
-    if (rx_index == -1)
+#ifdef STREAMING_RECEIVE
+    // only the EDC comparison is left
+    decode_result_t result = stream_end(decoder);
+#else
+    // decode in place, the raw samples are not needed afterwards
+    decode_result_t result = decode_frame(rx_buf, rx_len, command);
+#endif
+    stamps[STAMP_DECODED] = TCB0.CNT;
+
+#ifdef CAPTURE_FRAMES
+    // keep the raw frame for dump_frame()
+    captured_len = rx_len;
+    captured_result = result;
+
+    // no response will follow, so dump it right away
+    if (result != DECODE_OK)
+        dump_frame();
+#endif
+
+    switch (result)
     {
+    case DECODE_SYNC_ERROR:
         Serial_println("Sync error");
         return nullptr;
-    }
-
-    // skip sync pattern
-    rx_index += 4;
-
-    // decode data
-    int index = 0;
-    for (int i = rx_index; i < rx_len - 2; i += 2)
-    {
-        uint8_t x = extract_byte(shift, rx_buf[i], rx_buf[i + 1], rx_buf[i + 2]);
-
-        if (invert)
-            x = ~x;
-
-        command[index++] = x;
-    }
-
-    // verify length
-    int len = command[0];
-    if (len + 2 > index)
-    {
+    case DECODE_LENGTH_ERROR:
         Serial_println("Length error");
         return nullptr;
-    }
-
-    // verify EDC (Error Detection Code)
-    uint16_t calculated_edc = crc16(command, len);
-    uint16_t received_edc = (command[len] << 8) | command[len + 1];
-
-    if ((calculated_edc ^ received_edc) <= 1)
-    {
-        // allow last 1-bit error
-    }
-    else
-    {
+    case DECODE_EDC_ERROR:
         Serial_println("EDC error");
         return nullptr;
+    default:
+        break;
     }
 
     return command;
@@ -384,23 +381,56 @@ packet_t receive_command()
 // enable or disable transmission
 void enable_transmit(bool enable)
 {
-    // flash buffer
-    SPI_transfer(0x00);
-    SPI_transfer(0x00);
-
     if (enable)
+    {
+#ifdef HARDWARE_MANCHESTER
+        // one TCA0 period per bit while transmitting (see silica.h)
+        // the flush below lets the buffered values take effect first
+        TCA0.SINGLE.PERBUF = TX_TCA_PERIOD;
+        TCA0.SINGLE.CMP0BUF = TX_TCA_CMP;
+        TCA0.SINGLE.CMP1BUF = TX_TCA_CMP;
+#endif
+
+        // flush buffer
+        SPI_transfer(0x00);
+        SPI_transfer(0x00);
+
+        SPI0.INTFLAGS = SPI_TXCIF_bm;
         CCL.CTRLA = CCL_ENABLE_bm;
-    else
-        CCL.CTRLA = 0;
+        return;
+    }
+
+    // re-arm the receiver as soon as the last byte has been shifted out,
+    // so that a reader sending its next command right away is not missed
+    while (!(SPI0.INTFLAGS & SPI_TXCIF_bm))
+    {
+        // do nothing
+    }
+    CCL.CTRLA = 0;
+
+#ifdef HARDWARE_MANCHESTER
+    // back to two samples per bit, WO1 is not used while receiving
+    TCA0.SINGLE.PERBUF = 7;
+    TCA0.SINGLE.CMP0BUF = 3;
+    TCA0.SINGLE.CMP1BUF = 0;
+#endif
+
+    // drop the samples received while transmitting (the echo of the
+    // response), capture_frame() starts with live samples
+    while (SPI0.INTFLAGS & SPI_RXCIF_bm)
+        (void)SPI0.DATA;
 }
 
 // transmit one byte with manchester encoding
 void transmit_byte(uint8_t data)
 {
-    static const uint8_t table[16] = {0x55, 0x56, 0x59, 0x5A, 0x65, 0x66, 0x69, 0x6A, 0x95, 0x96, 0x99, 0x9A, 0xA5, 0xA6, 0xA9, 0xAA};
-
-    SPI_transfer(table[data >> 4]);
-    SPI_transfer(table[data & 0xF]);
+#ifdef HARDWARE_MANCHESTER
+    // encoded by CCL LUT1
+    SPI_transfer(data);
+#else
+    SPI_transfer(manchester_table[data >> 4]);
+    SPI_transfer(manchester_table[data & 0xF]);
+#endif
 }
 
 // send response packet to the reader
@@ -413,12 +443,32 @@ void send_response(packet_t response)
     int len = response[0];
 
     // calculate EDC (Error Detection Code) in advance
-    uint16_t edc = crc16(response, len);
+    uint16_t edc;
+    if (stamp_response)
+    {
+        // timing probe: the response ends with the stamps
+        // the transmit stamp is taken last, after the EDC of everything before it
+        stamp_response = false;
+        uint8_t *stamp = arena + RESPONSE_OFFSET + len - 2 * (STAMP_COUNT - STAMP_PROCESSED);
+        stamp[0] = stamps[STAMP_PROCESSED] >> 8;
+        stamp[1] = stamps[STAMP_PROCESSED] & 0xFF;
+        edc = crc16(response, len - 2);
+
+        stamps[STAMP_TRANSMIT] = TCB0.CNT;
+        stamp[2] = stamps[STAMP_TRANSMIT] >> 8;
+        stamp[3] = stamps[STAMP_TRANSMIT] & 0xFF;
+        edc = _crc_xmodem_update(edc, stamp[2]);
+        edc = _crc_xmodem_update(edc, stamp[3]);
+    }
+    else
+    {
+        edc = crc16(response, len);
+    }
 
     enable_transmit(true);
 
     // send header
-    for (int i = 0; i < sizeof(header); i++)
+    for (int i = 0; i < HEADER_SIZE; i++)
         transmit_byte(header[i]);
 
     // send body
@@ -479,10 +529,37 @@ void setup()
     CCL.TRUTH0 = 0xF0;
     CCL.LUT0CTRLA = CCL_ENABLE_bm;
     CCL.LUT1CTRLA = 0;
+#ifdef HARDWARE_MANCHESTER
+    // XOR the SPI data with TCA0 WO1 (see silica.h)
+    // WO2 samples only once per bit at TX_TCA_PERIOD, so the synchronizer is
+    // clocked by CLK_PER and the filter removes the glitch where the SPI
+    // output lags the WO1 edge at bit boundaries
+    // unverified on hardware: whether the LUT sees WO1 with only CMP0EN set
+    CCL.LUT1CTRLB = CCL_INSEL1_TCA0_gc | CCL_INSEL0_EVENT0_gc;
+    CCL.LUT1CTRLC = CCL_INSEL2_MASK_gc;
+    CCL.TRUTH1 = TX_MANCHESTER_TRUTH;
+    CCL.LUT1CTRLA = CCL_FILTSEL_FILTER_gc | CCL_OUTEN_bm | CCL_ENABLE_bm;
+#else
     CCL.LUT1CTRLB = CCL_INSEL1_MASK_gc | CCL_INSEL0_EVENT0_gc;
     CCL.LUT1CTRLC = CCL_INSEL2_TCA0_gc;
     CCL.TRUTH1 = 0xAA;
     CCL.LUT1CTRLA = CCL_CLKSRC_bm | CCL_FILTSEL0_bm | CCL_OUTEN_bm | CCL_ENABLE_bm;
+#endif
+
+    // run TCB0 as a free-running timer at fc/4 (3.39MHz)
+    TCB0.CCMP = 0xFFFF;
+    TCB0.CTRLB = TCB_CNTMODE_INT_gc;
+    TCB0.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
+
+    // set VLM (Voltage Level Monitor) to 25% above the BOD level (2.25V)
+    BOD.VLMCTRLA = BOD_VLMLVL_25ABOVE_gc;
+
+    // set up the ADC to measure the 1.1V reference against VDD (see measure_vdd)
+    // ADC clock fclk/8, at most 848kHz with the fast clock
+    VREF.CTRLA = VREF_ADC0REFSEL_1V1_gc;
+    ADC0.CTRLC = ADC_SAMPCAP_bm | ADC_REFSEL_VDDREF_gc | ADC_PRESC_DIV8_gc;
+    ADC0.CTRLD = ADC_INITDLY_DLY32_gc;
+    ADC0.MUXPOS = ADC_MUXPOS_INTREF_gc;
 
     // set up USART for serial output
     PORTMUX.CTRLB |= PORTMUX_USART0_ALTERNATE_gc;
@@ -500,6 +577,86 @@ void setup()
     Serial_println(__DATE__);
 }
 
+// measure VDD with the ADC, converting the internal 1.1V reference
+// against VDD as the ADC reference
+// the ADC is only enabled while measuring, INITDLY lets the reference settle
+uint16_t vdd_convert()
+{
+    ADC0.CTRLA = ADC_ENABLE_bm;
+    ADC0.INTFLAGS = ADC_RESRDY_bm; // discard an old result
+    ADC0.COMMAND = ADC_STCONV_bm;
+    while (!(ADC0.INTFLAGS & ADC_RESRDY_bm))
+    {
+        // do nothing
+    }
+
+    uint16_t result = ADC0.RES; // clears RESRDY
+    ADC0.CTRLA = 0;
+    return result;
+}
+
+bool vdd_above_vlm()
+{
+    return !(BOD.STATUS & BOD_VDDS_bm);
+}
+
+// Functions for the user row (see silica.h)
+// the user row is written like the EEPROM, through the page buffer
+
+bool user_row_ready()
+{
+    return !(NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm);
+}
+
+uint8_t user_row_read(int offset)
+{
+    return ((volatile uint8_t *)&USERROW)[offset];
+}
+
+// start writing one byte, only the bytes loaded into the page buffer are erased
+void user_row_write(int offset, uint8_t data)
+{
+    while (!user_row_ready())
+    {
+        // do nothing
+    }
+    ((volatile uint8_t *)&USERROW)[offset] = data;
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+}
+
+#ifdef OTA_UPDATE
+// Functions for the firmware update (see update.h)
+// flash is memory mapped from MAPPED_PROGMEM_START
+
+const uint8_t *flash_data(uint16_t address)
+{
+    return (const uint8_t *)(MAPPED_PROGMEM_START + address);
+}
+
+// erase and write one page of APPDATA
+// the CPU halts until the write is complete
+void flash_write_page(uint16_t address, const uint8_t *data)
+{
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEBUFCLR_gc);
+
+    // writing to the mapped flash fills the page buffer
+    volatile uint8_t *page = (volatile uint8_t *)(MAPPED_PROGMEM_START + address);
+    for (int i = 0; i < FLASH_PAGE_SIZE; i++)
+        page[i] = data[i];
+
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+    while (NVMCTRL.STATUS & NVMCTRL_FBUSY_bm)
+    {
+        // do nothing
+    }
+}
+
+void request_reset()
+{
+    reset_requested = true;
+}
+#endif
+
 // test response for debugging
 // send a fixed polling response repeatedly
 void test_response()
@@ -521,20 +678,52 @@ void loop()
         return;
 
     packet_t response = process(command);
+    stamps[STAMP_PROCESSED] = TCB0.CNT;
     if (response == nullptr)
     {
         Serial_println("Unsupported command");
         save_error(command);
         print_packet(command);
+#ifdef CAPTURE_FRAMES
+        dump_frame();
+#endif
         return;
     }
 
+    // back to the slow clock for transmission
+    set_fast_clock(false);
+
     // delay for Polling command
-    // 1000us + 1500us = 2.5ms
+    // 2.5ms after the end of the command, independent of the processing time
+    // waited per slot, since 16 slots exceed the range of the timer
     if (command[1] == 0x00)
-        _delay_us(1500);
+    {
+        uint16_t start = stamps[STAMP_FRAME_END];
+        uint16_t delay = POLLING_DELAY_TICKS;
+        for (int i = 0; i <= response_time_slot; i++)
+        {
+            while ((uint16_t)(TCB0.CNT - start) < delay)
+            {
+                // deferred steps that end before the time slot
+                run_task(start + delay);
+            }
+            start += delay;
+            delay = TIME_SLOT_TICKS;
+        }
+    }
 
     send_response(response);
+
+#ifdef OTA_UPDATE
+    // software reset into the bootloader, which installs the update
+    if (reset_requested)
+        _PROTECTED_WRITE(RSTCTRL.SWRR, RSTCTRL_SWRE_bm);
+#endif
+
+#ifdef CAPTURE_FRAMES
+    // dump after the response to keep the reader timing intact
+    dump_frame();
+#endif
 }
 
 // Arduino-style main function
@@ -11,10 +11,185 @@ void Serial_write(uint8_t);
 void Serial_print(const char *);
 void Serial_println(const char *);
 
+// data link layer functions
+// result of decoding a captured frame
+enum decode_result_t : uint8_t
+{
+    DECODE_OK,
+    DECODE_SYNC_ERROR,
+    DECODE_LENGTH_ERROR,
+    DECODE_EDC_ERROR,
+};
+
+extern uint16_t corrected_errors;
+
+// data link layer header (preamble and sync code)
+constexpr int HEADER_SIZE = 8;
+extern const uint8_t header[HEADER_SIZE];
+
+// Manchester code of each nibble, MSB first, 2 bits per bit (1 -> 10, 0 -> 01)
+extern const uint8_t manchester_table[16];
+
+// Hardware Manchester encoding (HARDWARE_MANCHESTER)
+// While transmitting, TCA0 runs at one period per bit instead of one per
+// half bit, so the SPI shifts out plain data bytes. SCK (WO0) and WO1 are
+// high for the first TX_TCA_CMP counts; the SPI output changes at the
+// falling edge of SCK, and CCL LUT1 XORs it (IN0) with WO1 (IN1), which
+// is low in the first half of each bit and high in the second.
+// Not yet compared with the software encoder on a logic analyser, so no
+// PlatformIO env builds it; the host model is checked by fuzz.py.
+constexpr uint8_t TX_TCA_PERIOD = 15;          // fclk/16 = 212kHz
+constexpr uint8_t TX_TCA_CMP = 8;              // 50% duty
+constexpr uint8_t TX_MANCHESTER_TRUTH = 0x66;  // IN0 XOR IN1, IN2 ignored
+
+uint16_t crc16(const uint8_t *, int);
+int find_sync_index(const uint8_t *, int, int &, bool &);
+uint8_t extract_byte(int, uint8_t, uint8_t, uint8_t);
+decode_result_t decode_frame(const uint8_t *, int, uint8_t *);
+
+// Streaming decoder (STREAMING_RECEIVE, experimental)
+// Decodes the samples while they are captured, giving the same result as
+// decode_frame() on the whole frame without storing the raw samples.
+// stream_push() must return within the 64 CPU cycles between SPI bytes,
+// but an estimate from the C++ is about 100 cycles on the AVR. No
+// PlatformIO env builds it until a timed listing shows that it fits;
+// the host build (native.py, fuzz.py, replay.py) exercises the logic.
+// The EDC is accumulated per byte, so only the comparison (and a rare
+// single-bit correction) is left after the end of the frame.
+struct stream_decoder_t
+{
+    uint8_t *command;
+    uint8_t sample0, sample1; // previous two samples
+    int8_t shift;             // -1 until the sync pattern is found
+    bool invert;
+    int count;                // samples since the sync pattern
+    int index;                // decoded bytes
+    uint16_t edc;
+};
+
+void stream_begin(stream_decoder_t &, uint8_t *);
+void stream_push(stream_decoder_t &, uint8_t);
+decode_result_t stream_end(stream_decoder_t &);
+
+// Shared SRAM arena
+// The receive, command and response buffers are never all live at once,
+// so they share one arena. Lifetime plan for one command:
+//   capture_frame()  raw samples      [0, RX_BUF_SIZE)
+//   decode_frame()   command, decoded in place over the samples
+//                    [COMMAND_OFFSET, COMMAND_OFFSET + COMMAND_SIZE)
+//                    (each output byte is written behind the samples still to be read)
+//   process()        response, behind the live command
+//                    [RESPONSE_OFFSET, RESPONSE_OFFSET + RESPONSE_SIZE)
+//   send_response()  reads the response; the next capture overwrites everything
+// With STREAMING_RECEIVE the samples are decoded into the command as they
+// arrive, and RX_BUF_SIZE only limits the number of samples per frame.
+constexpr int RX_BUF_SIZE = 0x220;
+constexpr int COMMAND_SIZE = 0x110;
+constexpr int RESPONSE_SIZE = 0xFF;
+
+#ifdef CAPTURE_FRAMES
+// capture builds keep the raw samples for dump_frame() after the response
+constexpr int COMMAND_OFFSET = RX_BUF_SIZE;
+#else
+constexpr int COMMAND_OFFSET = 0;
+#endif
+constexpr int RESPONSE_OFFSET = COMMAND_OFFSET + COMMAND_SIZE;
+#ifdef STREAMING_RECEIVE
+#ifdef CAPTURE_FRAMES
+#error "CAPTURE_FRAMES needs the raw samples, which STREAMING_RECEIVE does not keep"
+#endif
+constexpr int ARENA_SIZE = RESPONSE_OFFSET + RESPONSE_SIZE;
+#else
+constexpr int ARENA_SIZE = RESPONSE_OFFSET + RESPONSE_SIZE > RX_BUF_SIZE ? RESPONSE_OFFSET + RESPONSE_SIZE : RX_BUF_SIZE;
+#endif
+
+extern uint8_t arena[ARENA_SIZE];
+
+// Timing probe
+// TCB0 stamps (fc/4 ticks) of the command being processed, taken by the
+// physical layer. A response that ends with all stamps (big-endian) sets
+// stamp_response; send_response() then fills in the stamps taken after
+// process() returned.
+enum stamp_t : uint8_t
+{
+    STAMP_FRAME_END, // end of the captured frame
+    STAMP_DECODED,   // frame decoded and EDC verified
+    STAMP_PROCESSED, // process() returned
+    STAMP_TRANSMIT,  // header transmission starts
+    STAMP_COUNT,
+};
+
+extern uint16_t stamps[STAMP_COUNT];
+extern bool stamp_response;
+
+// Deferred tasks
+// Work kept off the critical path is split into bounded steps, which the
+// physical layer runs only in the gaps between frames (see run_task()).
+enum task_id_t : uint8_t
+{
+    TASK_SERIAL,     // send buffered serial output
+    TASK_SAVE_ERROR, // write the last failed command to EEPROM
+    TASK_COUNT,
+};
+
+// run-time accounting per task, in TCB0 ticks
+struct task_stats_t
+{
+    uint16_t steps;
+    uint16_t max_ticks; // longest step
+    uint16_t overruns;  // steps longer than the budget of the task
+    uint32_t total_ticks;
+};
+
+extern task_stats_t task_stats[TASK_COUNT];
+
+// schedule a task, its steps run until one returns true
+void defer(task_id_t);
+
+// Supply voltage
+// Non-volatile writes are refused or deferred while VDD is below
+// VDD_WRITE_MIN_MV, so that an erase/write cycle is not cut off by the
+// brown-out detector (1.8V, see fuses.c) on a weak field.
+constexpr uint16_t VDD_WRITE_MIN_MV = 2100;
+constexpr uint8_t LOW_VOLTAGE_ERROR = 0xC1; // status flag 2 of refused writes
+
+// status flag 2 of writes whose non-volatile content differs after writing
+constexpr uint8_t VERIFY_ERROR = 0x70;
+
+// ADC result of the 1.1V reference converted against VDD
+constexpr uint16_t vdd_counts(uint16_t mv) { return (uint32_t)1100 * 1023 / mv; }
+
+// level of the VLM (Voltage Level Monitor), 25% above the BOD level
+constexpr uint16_t VDD_VLM_MV = 2250;
+static_assert(VDD_VLM_MV >= VDD_WRITE_MIN_MV, "the VLM must not allow writes below the minimum");
+
+// convert the 1.1V reference against VDD, waiting for a new conversion
+// (about 120us); the ADC is only enabled during the call
+uint16_t vdd_convert();
+// return whether VDD is above VDD_VLM_MV, without the ADC
+// A conversion is longer than a deferred task step, so steps use this.
+bool vdd_above_vlm();
+// measure VDD in millivolts, waiting for the conversion
+uint16_t measure_vdd();
+// return whether VDD allows a non-volatile write, counting refusals
+bool write_supply_ok();
+extern uint16_t low_voltage_refusals;
+
+// User row: 32 bytes of non-volatile memory besides the EEPROM,
+// written one byte at a time like eeprom_write_byte()
+constexpr int USER_ROW_SIZE = 32;
+
+bool user_row_ready();
+uint8_t user_row_read(int offset);
+void user_row_write(int offset, uint8_t data);
+
 // application layer functions
+extern uint8_t response_time_slot;
+
 void initialize();
 packet_t process(packet_t);
 void save_error(packet_t);
+bool save_error_step();
 
 // debug functions
 void print_packet(packet_t);
@@ -0,0 +1,132 @@
+// Implementation of the firmware update service for
+// JIS X 6319-4 compatible card "SiliCa"
+// Write Without Encryption to UPDATE_SERVICE_CODE (see update.h):
+//   image blocks:  whole pages, consecutive block numbers from a page boundary
+//   commit block:  UPDATE_COMMIT_BLOCK alone, data is update_header_t
+// Block numbers above 0xFF use 3-byte block list elements (00 <low> <high>).
+
+#include <string.h>
+#include "silica.h"
+#include "update.h"
+
+#ifdef OTA_UPDATE
+
+// response buffer, shared with the application layer
+static uint8_t *const response = arena + RESPONSE_OFFSET;
+
+static bool write_status(uint8_t status_flag1, uint8_t status_flag2)
+{
+    response[0] = 12;             // length
+    response[10] = status_flag1; // status flag 1
+    response[11] = status_flag2; // status flag 2
+    return true;
+}
+
+// parse a block list with 16-bit block numbers
+// size is the number of bytes available from block_list
+// return size of block list, 0 on error
+static int parse_update_block_list(int n, const uint8_t *block_list, int size, uint16_t *block_nums)
+{
+    int j = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (j + 2 <= size && block_list[j] == 0x80)
+        {
+            // 2-byte block list element
+            block_nums[i] = block_list[j + 1];
+            j += 2;
+        }
+        else if (j + 3 <= size && block_list[j] == 0x00)
+        {
+            // 3-byte block list element, block number in little-endian
+            block_nums[i] = block_list[j + 1] | (block_list[j + 2] << 8);
+            j += 3;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    return j;
+}
+
+// verify the staged image and mark it for the bootloader
+static bool commit(const uint8_t *data)
+{
+    const update_header_t *header = (const update_header_t *)data;
+    uint16_t size = (header->size[0] << 8) | header->size[1];
+    uint16_t crc = (header->crc[0] << 8) | header->crc[1];
+
+    if (memcmp(header->magic, UPDATE_MAGIC, sizeof(UPDATE_MAGIC)) != 0)
+        return write_status(0xFF, 0xA8);
+    if (size == 0 || size > IMAGE_MAX)
+        return write_status(0xFF, 0xA8);
+
+    if (crc16(flash_data(STAGE_START), size) != crc)
+        return write_status(0xFF, UPDATE_CRC_ERROR);
+
+    if (!write_supply_ok())
+        return write_status(0xFF, LOW_VOLTAGE_ERROR);
+
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page, header, sizeof(update_header_t));
+    flash_write_page(HEADER_ADDRESS, page);
+    if (memcmp(flash_data(HEADER_ADDRESS), page, sizeof(page)) != 0)
+        return write_status(0xFF, UPDATE_VERIFY_ERROR);
+
+    // the bootloader installs the image after the response
+    request_reset();
+    return write_status(0x00, 0x00);
+}
+
+bool update_write(packet_t command)
+{
+    int len = command[0];
+    int n = command[13]; // number of blocks
+
+    if (!(1 <= n && n <= UPDATE_BLOCK_MAX))
+        return write_status(0xFF, 0xA2);
+
+    uint16_t block_nums[UPDATE_BLOCK_MAX];
+    int N = parse_update_block_list(n, command + 14, len - 14, block_nums);
+    if (N == 0)
+        return write_status(0xFF, 0xA6);
+
+    // check length
+    if (len != 14 + N + 16 * n)
+        return false;
+
+    const uint8_t *data = command + 14 + N;
+
+    if (n == 1 && block_nums[0] == UPDATE_COMMIT_BLOCK)
+        return commit(data);
+
+    // whole pages of consecutive blocks within the staging area
+    uint16_t first = block_nums[0];
+    if (n % BLOCKS_PER_PAGE != 0 || first % BLOCKS_PER_PAGE != 0)
+        return write_status(0xFF, 0xA8);
+    if (16L * (first + n) > IMAGE_MAX)
+        return write_status(0xFF, 0xA8);
+    for (int i = 1; i < n; i++)
+    {
+        if (block_nums[i] != first + i)
+            return write_status(0xFF, 0xA8);
+    }
+
+    for (int i = 0; i < n / BLOCKS_PER_PAGE; i++)
+    {
+        uint16_t address = STAGE_START + 16 * first + FLASH_PAGE_SIZE * i;
+        const uint8_t *page = data + FLASH_PAGE_SIZE * i;
+
+        if (!write_supply_ok())
+            return write_status(0xFF, LOW_VOLTAGE_ERROR);
+        flash_write_page(address, page);
+        if (memcmp(flash_data(address), page, FLASH_PAGE_SIZE) != 0)
+            return write_status(0xFF, UPDATE_VERIFY_ERROR);
+    }
+
+    return write_status(0x00, 0x00);
+}
+
+#endif
@@ -0,0 +1,56 @@
+// Firmware update over the air (OTA_UPDATE)
+// Flash layout of ATtiny1616 with the update fuses (see fuses.c):
+//   BOOT     [0x0000, BOOT_SIZE)      bootloader (boot/boot.cpp)
+//   APPCODE  [BOOT_SIZE, STAGE_START) application, at most IMAGE_MAX bytes
+//   APPDATA  [STAGE_START, FLASH_SIZE) staged image, header in the last page
+// The application stages a new image in APPDATA through Write Without
+// Encryption to UPDATE_SERVICE_CODE, verifying every page after writing.
+// Writing the commit block checks the CRC of the whole staged image and
+// marks the header committed. The card then resets, and the bootloader
+// copies the image to APPCODE, verifying each page, and erases the header
+// only after the copy is complete, so an interrupted copy is resumed.
+#pragma once
+#include <stdint.h>
+#include "silica.h"
+
+constexpr uint16_t FLASH_SIZE = 0x4000;
+constexpr int FLASH_PAGE_SIZE = 64;
+constexpr uint16_t BOOT_SIZE = 0x200;   // BOOTEND = 2
+constexpr uint16_t STAGE_START = 0x2000; // APPEND = 32
+constexpr uint16_t IMAGE_MAX = STAGE_START - BOOT_SIZE;
+constexpr uint16_t HEADER_ADDRESS = FLASH_SIZE - FLASH_PAGE_SIZE;
+
+static_assert(STAGE_START + IMAGE_MAX <= HEADER_ADDRESS, "staging area overlaps the header");
+
+// service code of the update service (random write without key)
+constexpr uint16_t UPDATE_SERVICE_CODE = 0x1009;
+// block number of the commit block, image blocks are numbered from 0
+constexpr uint16_t UPDATE_COMMIT_BLOCK = 0xFFFF;
+// image data per write, whole pages only
+constexpr int UPDATE_BLOCK_MAX = 12;
+constexpr int BLOCKS_PER_PAGE = FLASH_PAGE_SIZE / 16;
+
+// status flag 2 of failed update writes
+constexpr uint8_t UPDATE_VERIFY_ERROR = VERIFY_ERROR; // flash content differs after writing
+constexpr uint8_t UPDATE_CRC_ERROR = 0x71;            // CRC of the staged image does not match
+
+// Header page, also the data of the commit block
+// magic "SiUp", image size in bytes and CRC16 of the image, both big-endian
+struct update_header_t
+{
+    uint8_t magic[4];
+    uint8_t size[2];
+    uint8_t crc[2];
+    uint8_t reserved[8];
+};
+
+constexpr uint8_t UPDATE_MAGIC[4] = {'S', 'i', 'U', 'p'};
+
+// Flash access, implemented by the physical layer (or the host)
+// flash_write_page() erases and writes one page of APPDATA
+const uint8_t *flash_data(uint16_t address);
+void flash_write_page(uint16_t address, const uint8_t *data);
+// reset after the current response has been sent
+void request_reset();
+
+bool update_write(packet_t);
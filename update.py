@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+
+# Update the firmware of SiliCa cards over the air (env:ATtiny1616_ota).
+# The image is staged in the card with Write Without Encryption to the
+# update service, three flash pages per command, each page verified by the
+# card after writing. The commit block then makes the card check the CRC of
+# the whole image and reset into the bootloader, which installs it.
+# See src/1_1/src/update.h for the protocol.
+# Usage examples:
+# python update.py .pio/build/ATtiny1616_ota/firmware.hex
+# python update.py firmware.bin --count 20
+
+import sys
+import time
+import argparse
+
+import nfc
+
+from capture import crc16
+from native import BOOT_SIZE, FLASH_PAGE_SIZE, STAGE_START, UPDATE_MAGIC
+
+COMMAND_WRITE = 0x08
+UPDATE_SERVICE_CODE = 0x1009
+UPDATE_COMMIT_BLOCK = 0xFFFF
+# blocks per command, whole pages only
+UPDATE_BLOCK_MAX = 12
+IMAGE_MAX = STAGE_START - BOOT_SIZE
+
+# status flag 2 of failed update writes
+UPDATE_ERRORS = {
+    0x70: "flash verification failed",
+    0x71: "image CRC mismatch",
+    0xC1: "supply voltage too low, hold the card closer",
+}
+
+
+class UpdateError(Exception):
+    """
+    A status the card returned for an update write.
+    """
+
+
+def load_hex(path: str) -> bytes:
+    """
+    Load an Intel HEX file of the application, linked at BOOT_SIZE.
+    """
+    memory = {}
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(":"):
+                continue
+            record = bytes.fromhex(line[1:])
+            if sum(record) & 0xFF:
+                raise ValueError(f"checksum error in {line}")
+            count, address, kind = record[0], int.from_bytes(record[1:3], "big"), record[3]
+            data = record[4:4 + count]
+            if kind == 0x00:
+                for i, b in enumerate(data):
+                    memory[base + address + i] = b
+            elif kind == 0x01:
+                break
+            elif kind == 0x02:
+                base = int.from_bytes(data, "big") << 4
+            elif kind == 0x04:
+                base = int.from_bytes(data, "big") << 16
+    if not memory:
+        raise ValueError("no data")
+    if min(memory) < BOOT_SIZE:
+        raise ValueError(f"image starts below {BOOT_SIZE:#x}, not built for the bootloader")
+    end = max(memory) + 1
+    return bytes(memory.get(a, 0xFF) for a in range(BOOT_SIZE, end))
+
+
+def load_image(path: str) -> bytes:
+    """
+    Load an application image (Intel HEX or raw binary starting at BOOT_SIZE),
+    padded to whole pages.
+    """
+    if path.lower().endswith(".hex"):
+        image = load_hex(path)
+    else:
+        with open(path, "rb") as f:
+            image = f.read()
+    image += b"\xFF" * (-len(image) % FLASH_PAGE_SIZE)
+    if not image or len(image) > IMAGE_MAX:
+        raise ValueError(f"image must be between 1 and {IMAGE_MAX} bytes")
+    return image
+
+
+def block_list(block_nums: list[int]) -> bytes:
+    """
+    Build a block list, with 3-byte block list elements for block numbers above 0xFF.
+    """
+    return b"".join(bytes([0x80, n]) if n <= 0xFF else bytes([0x00, n & 0xFF, n >> 8])
+                    for n in block_nums)
+
+
+def write_update(tag: nfc.tag.Tag, blocks: list[tuple[int, bytes]], timeout: float) -> None:
+    cmd_data = bytes([1]) + UPDATE_SERVICE_CODE.to_bytes(2, "little") + bytes([len(blocks)])
+    cmd_data += block_list([n for n, _ in blocks])
+    cmd_data += b"".join(data for _, data in blocks)
+    rsp = tag.send_cmd_recv_rsp(COMMAND_WRITE, cmd_data, timeout, check_status=False)
+    if rsp[0] != 0x00:
+        error = UPDATE_ERRORS.get(
+            rsp[1], f"status {rsp[0]:02X} {rsp[1]:02X}, the card might not support updates")
+        raise UpdateError(error)
+
+
+def update(tag: nfc.tag.Tag, image: bytes, timeout: float = 1.0) -> None:
+    """
+    Stage and commit an image.
+    Raises UpdateError when the card refuses a write, or
+    nfc.tag.tt3.Type3TagCommandError when it does not answer.
+    """
+    blocks = [(i, image[16 * i:16 * (i + 1)]) for i in range(len(image) // 16)]
+    for i in range(0, len(blocks), UPDATE_BLOCK_MAX):
+        write_update(tag, blocks[i:i + UPDATE_BLOCK_MAX], timeout)
+
+    header = UPDATE_MAGIC + len(image).to_bytes(2, "big") + crc16(image).to_bytes(2, "big")
+    header += bytes(16 - len(header))
+    write_update(tag, [(UPDATE_COMMIT_BLOCK, header)], timeout)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Update the firmware of SiliCa cards over the air.",
+    )
+    parser.add_argument("image", help="application image (.hex, or .bin starting at 0x200)")
+    parser.add_argument("-c", "--count", type=int, default=1,
+                        help="number of cards to update")
+    args = parser.parse_args(argv[1:])
+
+    try:
+        image = load_image(args.image)
+    except (OSError, ValueError) as exc:
+        print("Invalid image:", exc)
+        return 1
+    print(f"Image: {len(image)} bytes, CRC {crc16(image):04X}")
+
+    done = 0
+    failed = 0
+
+    def on_connect(tag):
+        nonlocal done, failed
+        start = time.perf_counter()
+        try:
+            update(tag, image)
+            error = None
+        except UpdateError as exc:
+            error = str(exc)
+        except nfc.tag.tt3.Type3TagCommandError as exc:
+            error = f"{exc}. The card might not support updates."
+        elapsed = time.perf_counter() - start
+
+        if error is None:
+            done += 1
+            print(f"Card {done}: updated in {elapsed:.3f} s "
+                  f"({len(image) / elapsed / 1024:.1f} KiB/s), restarting")
+        else:
+            failed += 1
+            print(f"Card failed after {elapsed:.3f} s: {error}")
+        print("Remove the card")
+        return True  # wait for removal
+
+    try:
+        with nfc.ContactlessFrontend("usb") as clf:
+            while done < args.count:
+                print("Waiting for a FeliCa...")
+                if not clf.connect(rdwr={"targets": ["212F"], "on-connect": on_connect}):
+                    break  # interrupted
+    except Exception as exc:
+        print("Error:", exc)
+        return 1
+
+    if done:
+        print(f"{done} cards updated, {failed} failed")
+    return 0 if done == args.count else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,271 @@
+#!/usr/bin/env python3
+
+# Virtual SiliCa card for running host tools without hardware.
+# The firmware (frame decoder and application layer) is compiled natively
+# (see native.py); its EEPROM is kept in an image file between runs.
+# Commands are Manchester encoded into raw samples like the card sees
+# them on air, so injected bit errors go through the real decoder.
+#
+# Importing this module registers the nfcpy device path
+#   silica:<eeprom image>[?latency=<seconds>&ber=<bit error rate>&seed=<n>&vdd=<mV>]
+# Existing scripts run unmodified with "usb" redirected to a virtual card:
+# python virtual.py card.eep check.py
+# python virtual.py card.eep --ber 1e-4 --latency 0.002 write.py idm 1122334455667788
+# python bench.py --device "silica:card.eep?latency=0.001"
+# python virtual.py card.eep -D OTA_UPDATE update.py firmware.bin
+#
+# The driver follows the nfcpy Device interface (sense_ttf and
+# send_cmd_recv_rsp), but has only been run against a minimal stand-in
+# for the nfc package, not nfcpy itself. Results through ContactlessFrontend,
+# e.g. of check.py, are unverified until it is tried with nfcpy.
+
+import ctypes
+import os
+import random
+import runpy
+import sys
+import time
+import argparse
+from urllib.parse import parse_qs
+
+import nfc
+import nfc.clf.device
+
+import native
+from capture import HEADER, crc16, demodulate, flip_bits, modulate
+
+class VirtualCard:
+    """
+    Natively compiled SiliCa with a persistent EEPROM image.
+    """
+
+    def __init__(self, image: str, latency: float = 0.0, ber: float = 0.0,
+                 seed: int | None = None, flags: tuple[str, ...] = (),
+                 vdd: int | None = None):
+        self.image = image
+        self.latency = latency
+        self.ber = ber
+        self.rng = random.Random(seed)
+        self.lib = native.load(flags)
+        self.response = ctypes.create_string_buffer(0x100)
+        self.chips = ctypes.create_string_buffer(2 * (len(HEADER) + 0x100 + 2))
+        self.hardware_manchester = "-DHARDWARE_MANCHESTER" in flags
+        if vdd is not None:
+            self.lib.silica_set_vdd(vdd)  # supply voltage on a weak field
+        self.flash = None
+        if hasattr(self.lib, "silica_flash"):
+            # the flash only lives as long as the card object
+            self.flash = (ctypes.c_uint8 * native.FLASH_SIZE).from_address(
+                ctypes.addressof(self.lib.silica_flash().contents))
+
+        size = self.lib.silica_eeprom_size()
+        self.eeprom = (ctypes.c_uint8 * size).from_address(
+            ctypes.addressof(self.lib.silica_eeprom().contents))
+        if os.path.exists(image):
+            with open(image, "rb") as f:
+                data = f.read()
+            if len(data) != size:
+                raise ValueError(f"{image} is not an EEPROM image of this firmware")
+        else:
+            data = b"\xFF" * size  # erased EEPROM
+        ctypes.memmove(self.eeprom, data, size)
+        self.lib.silica_initialize()
+
+    def save(self) -> None:
+        with open(self.image, "wb") as f:
+            f.write(bytes(self.eeprom))
+
+    def install_update(self) -> bool:
+        """
+        Model of the bootloader (src/1_1/boot/boot.cpp) after a reset.
+        Returns True if a committed image was installed.
+        """
+        header = bytes(self.flash[native.HEADER_ADDRESS:native.HEADER_ADDRESS + 16])
+        size = int.from_bytes(header[4:6], "big")
+        if header[:4] != native.UPDATE_MAGIC or not 0 < size <= native.STAGE_START - native.BOOT_SIZE:
+            return False
+        image = bytes(self.flash[native.STAGE_START:native.STAGE_START + size])
+        if crc16(image) != int.from_bytes(header[6:8], "big"):
+            return False
+        self.flash[native.BOOT_SIZE:native.BOOT_SIZE + size] = image
+        self.flash[native.HEADER_ADDRESS:native.HEADER_ADDRESS + native.FLASH_PAGE_SIZE] = \
+            b"\xFF" * native.FLASH_PAGE_SIZE
+        return True
+
+    def exchange(self, packet: bytes) -> bytes | None:
+        """
+        Send a command packet (starting with the length byte).
+        Returns the response packet, or None if the card does not answer.
+        Raises nfc.clf.TransmissionError for a corrupted response.
+        """
+        if self.latency:
+            time.sleep(self.latency)
+
+        raw = modulate(packet, self.rng.randrange(8), self.rng.random() < 0.5,
+                       self.ber, self.rng)
+        before = bytes(self.eeprom)
+        length = self.lib.silica_receive(raw, len(raw), self.response)
+        if bytes(self.eeprom) != before:
+            self.save()
+        if self.flash is not None and self.lib.silica_reset_requested():
+            # the response is sent before the reset
+            self.install_update()
+            self.lib.silica_initialize()
+        if length == 0:
+            return None
+
+        response = self.response.raw[:length]
+        # send it through the transmit encoder of the build
+        size = self.lib.silica_encode(response, self.chips, self.hardware_manchester)
+        frame = demodulate(self.chips.raw[:size]) if size else None
+        if frame != HEADER + response + crc16(response).to_bytes(2, "big"):
+            raise nfc.clf.TransmissionError("invalid Manchester code in response")
+
+        # the reader discards responses with EDC errors
+        nbits = 8 * (length + 2)
+        if flip_bits(0, nbits, self.ber, self.rng):
+            raise nfc.clf.TransmissionError("EDC error in response")
+        return response
+
+
+class Device(nfc.clf.device.Device):
+    """
+    nfcpy device driver talking to a VirtualCard.
+    """
+
+    def __init__(self, card: VirtualCard, path: str):
+        self.card = card
+        self._path = path
+
+    def __str__(self):
+        return f"SiliCa virtual card at {self._path}"
+
+    vendor_name = "SiliCa"
+    product_name = "Virtual Card"
+    chipset_name = "native"
+
+    @property
+    def path(self):
+        return self._path
+
+    def close(self):
+        self.card.save()
+
+    def mute(self):
+        pass
+
+    def sense_tta(self, target):
+        return None
+
+    def sense_ttb(self, target):
+        return None
+
+    def sense_dep(self, target):
+        return None
+
+    def sense_ttf(self, target):
+        if target.brty not in ("212F", "424F"):
+            return None
+        # Polling: system code FFFF, request system code
+        sensf_req = target.sensf_req or bytes.fromhex("00FFFF0100")
+        rsp = self.card.exchange(bytes([len(sensf_req) + 1]) + bytes(sensf_req))
+        if rsp is None:
+            return None
+        return nfc.clf.RemoteTarget("212F", sensf_res=bytearray(rsp[1:]))
+
+    def listen_tta(self, target, timeout):
+        return None
+
+    def listen_ttb(self, target, timeout):
+        return None
+
+    def listen_ttf(self, target, timeout):
+        return None
+
+    def listen_dep(self, target, timeout):
+        return None
+
+    def send_cmd_recv_rsp(self, target, data, timeout):
+        rsp = self.card.exchange(bytes(data))
+        if rsp is None:
+            raise nfc.clf.TimeoutError
+        return bytearray(rsp)
+
+    def get_max_send_data_size(self, target):
+        return 0xFF
+
+    def get_max_recv_data_size(self, target):
+        return 0xFF
+
+
+def parse_path(path: str) -> VirtualCard:
+    """
+    silica:<image>[?latency=..&ber=..&seed=..&vdd=..&define=..]
+    """
+    image, _, query = path[len("silica:"):].partition("?")
+    values = parse_qs(query)
+    options = {k: v[-1] for k, v in values.items()}
+    return VirtualCard(
+        image,
+        latency=float(options.get("latency", 0.0)),
+        ber=float(options.get("ber", 0.0)),
+        seed=int(options["seed"]) if "seed" in options else None,
+        flags=tuple(f"-D{d}" for d in values.get("define", [])),
+        vdd=int(options["vdd"]) if "vdd" in options else None,
+    )
+
+
+_connect = nfc.clf.device.connect
+_redirect = None
+
+
+def connect(path):
+    if _redirect is not None and path.startswith("usb"):
+        path = _redirect
+    if path.startswith("silica:"):
+        return Device(parse_path(path), path)
+    return _connect(path)
+
+
+nfc.clf.device.connect = connect
+
+
+def main(argv):
+    global _redirect
+
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Run a SiliCa host tool against a virtual card instead of a USB reader.",
+    )
+    parser.add_argument("image", help="EEPROM image file (created if missing)")
+    parser.add_argument("--latency", type=float, default=0.0,
+                        help="extra delay per exchange in seconds")
+    parser.add_argument("--ber", type=float, default=0.0,
+                        help="bit error rate on air, both directions")
+    parser.add_argument("--seed", type=int, help="random seed for errors")
+    parser.add_argument("--vdd", type=int, help="supply voltage of the card in mV")
+    parser.add_argument("-D", dest="defines", action="append", default=[],
+                        help="firmware build flag, e.g. -D OTA_UPDATE")
+    parser.add_argument("script", help="script to run, e.g. check.py")
+    parser.add_argument("args", nargs=argparse.REMAINDER, help="arguments of the script")
+    args = parser.parse_args(argv[1:])
+
+    _redirect = f"silica:{args.image}?latency={args.latency}&ber={args.ber}"
+    if args.seed is not None:
+        _redirect += f"&seed={args.seed}"
+    if args.vdd is not None:
+        _redirect += f"&vdd={args.vdd}"
+    for define in args.defines:
+        _redirect += f"&define={define}"
+
+    sys.argv = [args.script] + args.args
+    sys.path.insert(0, os.path.dirname(os.path.abspath(args.script)))
+    try:
+        runpy.run_path(args.script, run_name="__main__")
+    except SystemExit as exc:
+        return exc.code
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
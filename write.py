@@ -16,15 +16,19 @@ import sys
 import argparse
 import nfc
 
-COMMAND_WRITE = 0x08
+from provision import write_blocks
+
 DEFAULT_PMM = bytes.fromhex("0001FFFFFFFFFFFF")  # 8 bytes
 MAX_SYSTEM = 4
 MAX_SERVICE = 4
 
 
-def write_system_block(tag: nfc.tag.Tag, block_num: int, data: bytes, timeout: float = 1.0) -> None:
+def write_system_block(tag: nfc.tag.Tag, block_num: int, data: bytes,
+                       timeout: float = 1.0) -> Optional[str]:
     """
-    Write a 16-byte system block to a FeliCa tag.
+    Write a 16-byte system block to a FeliCa tag in a single command,
+    confirmed by the CRC of the stored block in the response.
+    Returns None on success or an error message.
     Raises nfc.tag.tt3.Type3TagCommandError on write failure.
     """
     if not (0 <= block_num <= 0xFF):
@@ -34,13 +38,7 @@ def write_system_block(tag: nfc.tag.Tag, block_num: int, data: bytes, timeout: f
 
     # print(f"Writing block {block_num:02X}h with data: {data.hex().upper()}")
 
-    cmd_data = bytearray([1, 0xFF, 0xFF, 1, 0x80, block_num]) + data
-    tag.send_cmd_recv_rsp(COMMAND_WRITE, bytes(cmd_data), timeout)
-
-    if block_num == 0x83:
-        tag.idm = data[0:8]  # Update IDm if written
-    # Second write to ensure data is written correctly
-    tag.send_cmd_recv_rsp(COMMAND_WRITE, bytes(cmd_data), timeout)
+    return write_blocks(tag, [(block_num, data)], timeout)
 
 
 def parse_hex_parameter(s: str) -> Optional[bytes]:
@@ -138,11 +136,14 @@ def main(argv):
             print("Tag found:", tag)
 
             try:
-                write_system_block(tag, block_num, data)
+                error = write_system_block(tag, block_num, data)
             except nfc.tag.tt3.Type3TagCommandError:
                 print(
                     f"Unable to write to block {block_num:02X}h. The tag might not be a SiliCa.")
                 return 1
+            if error is not None:
+                print(error)
+                return 1
 
     except Exception as exc:
         print("Error:", exc)